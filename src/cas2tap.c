@@ -7,10 +7,19 @@
  * It can rename the stored program name.
  * The Color Genie documentation contains bad information from tape structure. It contains the TRS80 informations.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "getopt.h"
+#include "memimage.h"
 
 #define VM 0
 #define VS 4
@@ -18,10 +27,17 @@
 
 // Help for correct leader information : eg2000 - basicrom.pdf
 
-int body_only = 0; // If true, then leader does not write into .tap file
-unsigned char new_name[ 7 ] = { 0,0,0,0,0,0,0 }; // The new program name, if not empty
+static int body_only = 0; // If true, then leader does not write into .tap file
+static unsigned char new_name[ 7 ] = { 0,0,0,0,0,0,0 }; // The new program name, if not empty
 
-void fblockread( void *bytes, size_t size, FILE *src ) {
+// BASIC program image: the ROM relinks the lines after CLOAD and sets these pointers.
+#define BASIC_START 0x5801 // BASIC program area
+#define TXTTAB 0x40A4      // BASIC pointers in the Level II compatible communication area
+#define VARTAB 0x40F9
+#define ARYTAB 0x40FB
+#define STREND 0x40FD
+
+static void fblockread( void *bytes, size_t size, FILE *src ) {
     int pos = ftell( src );
 
     int ret = fread( bytes, size, 1, src );
@@ -43,7 +59,7 @@ void fblockread( void *bytes, size_t size, FILE *src ) {
  * TRS80 leader :  256 x 0x00 + 0x5A
  * EG2000 leader : 255 x 0xAA + 0x66
  */
-void write_leading( FILE *tap ) {
+static void write_leading( FILE *tap ) {
     if ( !body_only ) {
         unsigned char bytes[] = { 0xAA, 0x66 }; // The correct data
         for( int i=0; i<255; i++ ) fwrite( &bytes[0], 1, 1, tap );
@@ -51,7 +67,32 @@ void write_leading( FILE *tap ) {
     }
 }
 
-void test_header( FILE *cas, FILE *tap ) {
+/**
+ * Relinks the BASIC program in the memory, like the ROM after CLOAD, and sets the program pointers.
+ */
+static void image_basic( unsigned int size ) {
+    unsigned int pos = BASIC_START;
+    unsigned int end = BASIC_START + size;
+    while ( pos + 1 < end && ( memory[ pos ] || memory[ pos + 1 ] ) ) {
+        unsigned int next = pos + 4;
+        while ( next < end && memory[ next ] ) next++;
+        if ( next >= end ) {
+            fprintf( stderr, "Invalid BASIC line at 0x%04X\n", pos );
+            exit(1);
+        }
+        next++;
+        memory[ pos ] = next & 0xFF;
+        memory[ pos + 1 ] = next >> 8;
+        pos = next;
+    }
+    unsigned int vartab = pos + 2; // After the 0x0000 end link
+    image_region( BASIC_START, size );
+    unsigned short pointers[ 4 ][ 2 ] = { { TXTTAB, BASIC_START }, { VARTAB, vartab }, { ARYTAB, vartab }, { STREND, vartab } };
+    memcpy( fixups, pointers, sizeof( pointers ) );
+    fixupCount = 4;
+}
+
+static void test_header( FILE *cas, FILE *tap ) {
     unsigned int size = 0;
     unsigned char byte = 0; // tmp byte variable
     fseek( cas, 0, SEEK_SET );
@@ -109,7 +150,7 @@ void test_header( FILE *cas, FILE *tap ) {
     if ( tap ) write_leading( tap );
 }
 
-void test_basic_tap( FILE *cas, FILE *tap, unsigned char name_first_char ) {
+static void test_basic_tap( FILE *cas, FILE *tap, unsigned char name_first_char ) {
     fprintf( stdout, "BASIC type .cas file\n" );
     unsigned char byte; // tmp byte variable
 
@@ -134,6 +175,7 @@ void test_basic_tap( FILE *cas, FILE *tap, unsigned char name_first_char ) {
             finished = 1;
         } else {
             if ( tap ) fwrite( &byte, 1, 1, tap );
+            if ( imageName ) memory[ ( BASIC_START + size ) & 0xFFFF ] = byte;
             size++;
             if ( byte ) {
                 nullCounter = 0;
@@ -158,12 +200,23 @@ void test_basic_tap( FILE *cas, FILE *tap, unsigned char name_first_char ) {
     }
     fprintf( stdout, "Basic program size is %d bytes\n", size );
     fprintf( stdout, "Unique code id: C%dC%d\n", size, uidChecksum );
+    if ( imageName ) {
+        image.type = 1;
+        image.name[ 0 ] = new_name[ 0 ] ? new_name[ 0 ] : name_first_char;
+        if ( name_first_char == 0xD3 && size > 3 && memory[ BASIC_START ] == 0xD3 && memory[ BASIC_START + 1 ] == 0xD3 ) { // 3 x 0xD3 and the name before the program
+            if ( !new_name[ 0 ] ) image.name[ 0 ] = memory[ BASIC_START + 2 ];
+            size -= 3;
+            memmove( memory + BASIC_START, memory + BASIC_START + 3, size );
+        }
+        image_basic( size );
+    }
 }
 
-void test_system_filename_block( FILE *cas, FILE *tap ) {
+static void test_system_filename_block( FILE *cas, FILE *tap ) {
     unsigned char name[ 7 ] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
     fblockread( &name, 6, cas );
     fprintf( stdout, "SYSTEM program name: '%s'\n", name );
+    memcpy( image.name, new_name[ 0 ] ? new_name : name, 6 );
     if ( tap ) {
         if ( new_name[ 0 ] ) {
             fprintf( stdout, "Renamed to %s\n", new_name );
@@ -174,16 +227,17 @@ void test_system_filename_block( FILE *cas, FILE *tap ) {
     }
 }
 
-void test_system_entry_block( FILE *cas, FILE *tap ) {
+static void test_system_entry_block( FILE *cas, FILE *tap ) {
     unsigned char byte = 0; // tmp byte variable
     int address = 0;
     fblockread( &address, 2, cas );
     if ( tap ) fwrite( &address, 1, 2, tap );
+    image.entry = address;
     fprintf( stdout, "SYSTEM entry point: '%04X'\n", address );    
 }
 
 
-int test_system_data_block( FILE *cas, FILE *tap, int *uidChecksum ) {
+static int test_system_data_block( FILE *cas, FILE *tap, int *uidChecksum ) {
     unsigned char byte = 0; // tmp byte variable
     unsigned char sum = 0;
     uint address = 0;
@@ -203,11 +257,13 @@ int test_system_data_block( FILE *cas, FILE *tap, int *uidChecksum ) {
         sum += byte;
         *uidChecksum += byte;
         if ( tap ) fwrite( &byte, 1, 1, tap );
+        memory[ ( address + cnt ) & 0xFFFF ] = byte;
     }
     unsigned char checksum = fgetc( cas );
     if ( cnt == size ) {
         if ( sum == checksum ) {
             if ( tap ) fwrite( &checksum, 1, 1, tap );
+            if ( imageName ) image_region( address, size );
             fprintf( stdout, "%d bytes in SYSTEM DATA block from 0x%04X. Checksum ok (%02X)\n", size, pos, checksum );
         } else {
             int cpos = ftell( cas ) - 1; // 3C pos
@@ -222,7 +278,7 @@ int test_system_data_block( FILE *cas, FILE *tap, int *uidChecksum ) {
     return size;
 }
 
-void test_system_tap( FILE *cas, unsigned char first, FILE *tap ) {
+static void test_system_tap( FILE *cas, unsigned char first, FILE *tap ) {
     fprintf( stdout, "SYSTEM type .cas file\n" );
     int codeSize = 0;
     int uidChecksum = 0;
@@ -273,7 +329,7 @@ void test_system_tap( FILE *cas, unsigned char first, FILE *tap ) {
     fprintf( stdout, "Unique code id: S%dC%d\n", codeSize, uidChecksum );
 }
 
-void test_data_tap( FILE *cas, unsigned char first, FILE *tap ) {
+static void test_data_tap( FILE *cas, unsigned char first, FILE *tap ) {
     fprintf( stdout, "DATA type .cas file, with first %02X byte\n", first );
     unsigned char byte = 0; // tmp byte variable
     byte = first;
@@ -287,7 +343,7 @@ void test_data_tap( FILE *cas, unsigned char first, FILE *tap ) {
     }
 }
 
-void test_cas_body( FILE *cas, FILE *tap ) {
+static void test_cas_body( FILE *cas, FILE *tap ) {
     unsigned char byte = 0; // tmp byte variable
     byte = fgetc( cas );
     if ( byte == 0x55 || byte == 0x3C || byte == 0x78 ) {
@@ -301,14 +357,325 @@ void test_cas_body( FILE *cas, FILE *tap ) {
     }
 }
 
-void test_cas_file( FILE *cas, FILE *tap ) {
-    test_header( cas, tap );
-    test_cas_body( cas, tap );
+/**
+ * Checks the SYSTEM or BASIC body of a tap in memory from pos.
+ * Returns the end of the valid body, or 0 if the byte by byte conversion needed.
+ * The conversion needed, if there are bytes to drop between the blocks.
+ */
+static size_t tap_body_size( const unsigned char *data, size_t size, size_t pos, int *codeSize, int *uidChecksum ) {
+    *codeSize = 0;
+    *uidChecksum = 0;
+    if ( size <= pos ) return 0;
+    if ( data[ pos ] == 0x55 ) { // SYSTEM: name, data blocks, entry
+        pos += 7;
+        while ( pos < size && data[ pos ] == 0x3C ) {
+            if ( pos + 4 > size ) return 0;
+            unsigned int blockSize = data[ pos + 1 ] ? data[ pos + 1 ] : 256;
+            if ( pos + 5 + blockSize > size ) return 0;
+            unsigned char sum = data[ pos + 2 ] + data[ pos + 3 ];
+            for( unsigned int i=0; i<blockSize; i++ ) {
+                sum += data[ pos + 4 + i ];
+                *uidChecksum += data[ pos + 4 + i ];
+            }
+            if ( sum != data[ pos + 4 + blockSize ] ) return 0;
+            *codeSize += blockSize;
+            pos += 5 + blockSize;
+        }
+        if ( pos + 3 > size || data[ pos ] != 0x78 ) return 0;
+        return pos + 3;
+    } else if ( data[ pos ] != 0x3C && data[ pos ] != 0x78 ) { // BASIC: name character, body ends with 3 0x00
+        int nullCounter = 0;
+        for( pos++; pos < size && nullCounter < 3; pos++ ) {
+            *uidChecksum += data[ pos ];
+            (*codeSize)++;
+            nullCounter = data[ pos ] ? 0 : nullCounter + 1;
+        }
+        return nullCounter == 3 ? pos : 0;
+    }
+    return 0;
+}
+
+/**
+ * Checks the body of a canonical tap in memory: 255 x 0xAA + 0x66 leader, and the body.
+ * Returns the size of the valid tap prefix, or 0 if the byte by byte conversion needed.
+ */
+static size_t canonical_tap_size( const unsigned char *data, size_t size, int *codeSize, int *uidChecksum ) {
+    if ( size <= 256 ) return 0;
+    for( int i=0; i<255; i++ ) if ( data[ i ] != 0xAA ) return 0;
+    if ( data[ 255 ] != 0x66 ) return 0;
+    return tap_body_size( data, size, 256, codeSize, uidChecksum );
+}
+
+/**
+ * Fast path for the input, which is already a canonical tap file: 255 x 0xAA + 0x66 leader and clean blocks.
+ * The valid prefix copied by the kernel, the rename is a patch of the name in the copy.
+ * Returns 0, if the input is not a canonical tap.
+ */
+static int copy_canonical_tap( FILE *cas, FILE *tap ) {
+    struct stat st;
+    int casFd = fileno( cas );
+    int tapFd = fileno( tap );
+    if ( fstat( casFd, &st ) || !S_ISREG( st.st_mode ) || st.st_size <= 256 ) return 0;
+    unsigned char *data = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, casFd, 0 );
+    if ( data == MAP_FAILED ) return 0;
+    int codeSize = 0, uidChecksum = 0;
+    size_t size = canonical_tap_size( data, st.st_size, &codeSize, &uidChecksum );
+    if ( size ) {
+        unsigned char type = data[ 256 ];
+        loff_t inPos = 0, outPos = 0;
+        fflush( tap );
+        while ( inPos < size ) {
+            ssize_t ret = copy_file_range( casFd, &inPos, tapFd, &outPos, size - inPos, 0 );
+            if ( ret <= 0 ) break; // Not supported by the filesystem
+        }
+        while ( inPos < size ) {
+            ssize_t ret = pwrite( tapFd, data + inPos, size - inPos, outPos );
+            if ( ret <= 0 ) {
+                fprintf( stderr, "Tap file write error at pos 0x%04lX\n", (long)outPos );
+                exit(1);
+            }
+            inPos += ret;
+            outPos += ret;
+        }
+        fprintf( stdout, "Canonical EG2000 tap file, %ld bytes copied\n", (long)size );
+        if ( new_name[ 0 ] ) {
+            size_t nameSize = type == 0x55 ? 6 : 1;
+            off_t namePos = type == 0x55 ? 257 : 256;
+            if ( pwrite( tapFd, new_name, nameSize, namePos ) != nameSize ) {
+                fprintf( stderr, "Tap file write error at pos 0x%04lX\n", (long)namePos );
+                exit(1);
+            }
+            if ( type == 0x55 ) {
+                fprintf( stdout, "SYSTEM program name: '%.6s'\n", &data[ 257 ] );
+                fprintf( stdout, "Renamed to %s\n", new_name );
+            } else {
+                fprintf( stdout, "Basic program. The first character of the name is %c\n", type );
+                fprintf( stdout, "Renamed to %c\n", new_name[ 0 ] );
+            }
+        }
+        if ( size < st.st_size ) {
+            fprintf( stderr, "Drop %ld bytes after end of program from position 0x%04lX\n", (long)( st.st_size - size ), (long)size );
+        }
+        fprintf( stdout, "Unique code id: %c%dC%d\n", type == 0x55 ? 'S' : 'C', codeSize, uidChecksum );
+    }
+    munmap( data, st.st_size );
+    return size != 0;
+}
+
+/**
+ * Scan mode: finds the tapes in a large blob (disk image, cas collection, emulator save), and extracts them.
+ * Anchors: 0x66 after a 0xAA leader, 0xA5 after a 0x00 leader, the emulator header string, and the headerless
+ * SYSTEM name block (0x55, 6 printable characters, 0x3C). The candidates are validated by the block checks.
+ * The blob is split to chunks for the threads. A thread owns the anchors in its chunk, but it reads over the
+ * chunk borders for the leader and the body, so a tape on a border is found once.
+ */
+#define SCAN_MIN_LEADER 32
+#define SCAN_MAX_HEADER 256
+
+struct scan_hit {
+    size_t offset; // First byte of the leader or header
+    size_t body;   // First byte of the SYSTEM or BASIC body
+    size_t end;
+};
+
+struct scan_chunk {
+    const unsigned char *data;
+    size_t size;
+    size_t from, to;
+    struct scan_hit *hits;
+    int count;
+    pthread_t thread;
+};
+
+/**
+ * Checks the BASIC lines: the links are absolute addresses, so the difference of the links is the line size.
+ * The body starts with the name character, or with 3 x 0xD3 and the name. Returns the end of the body or 0.
+ */
+static size_t basic_body_size( const unsigned char *data, size_t size, size_t pos ) {
+    pos += ( pos + 3 < size && data[ pos ] == 0xD3 && data[ pos + 1 ] == 0xD3 && data[ pos + 2 ] == 0xD3 ) ? 4 : 1;
+    unsigned int address = 0, lineNumber = 0;
+    int lines = 0;
+    while ( pos + 2 <= size ) {
+        unsigned int link = data[ pos ] | data[ pos + 1 ] << 8;
+        if ( !link ) return lines ? pos + 2 : 0;
+        if ( pos + 5 > size ) return 0;
+        unsigned int number = data[ pos + 2 ] | data[ pos + 3 ] << 8;
+        if ( lines && number <= lineNumber ) return 0;
+        size_t next = pos + 4;
+        while ( next < size && next - pos < 300 && data[ next ] ) next++;
+        if ( next >= size || data[ next ] ) return 0;
+        next++;
+        if ( lines ) {
+            if ( link != address + ( next - pos ) ) return 0;
+        } else if ( link < 0x4000 + ( next - pos ) ) {
+            return 0;
+        }
+        address = link;
+        lineNumber = number;
+        lines++;
+        pos = next;
+    }
+    return 0;
+}
+
+static size_t scan_body_size( const unsigned char *data, size_t size, size_t pos ) {
+    int codeSize, uidChecksum;
+    if ( pos >= size ) return 0;
+    if ( data[ pos ] == 0x55 ) return tap_body_size( data, size, pos, &codeSize, &uidChecksum );
+    if ( data[ pos ] == 0x3C || data[ pos ] == 0x78 ) return 0;
+    return basic_body_size( data, size, pos );
+}
+
+// Leader run of the byte before pos. Returns the first byte of the run, or pos if it is too short.
+static size_t scan_leader( const unsigned char *data, size_t pos, unsigned char byte ) {
+    size_t start = pos;
+    while ( start && data[ start - 1 ] == byte ) start--;
+    return pos - start >= SCAN_MIN_LEADER ? start : pos;
+}
+
+static void scan_candidate( struct scan_chunk *chunk, size_t pos ) {
+    const unsigned char *data = chunk->data;
+    size_t size = chunk->size;
+    size_t offset = pos, body = 0, end;
+    switch ( data[ pos ] ) {
+        case 0x66: // EG2000 leader
+            if ( ( offset = scan_leader( data, pos, 0xAA ) ) < pos ) body = pos + 1;
+            break;
+        case 0xA5: // TRS-80 leader
+            if ( ( offset = scan_leader( data, pos, 0x00 ) ) < pos ) body = pos + 1;
+            break;
+        case 'C': // Emulator header, the string and 0x00 bytes, then 0x66
+            if ( pos + 34 < size && !memcmp( data + pos, "Colour Genie - Virtual Tape File", 32 ) ) {
+                size_t header = pos + 32;
+                while ( header + 1 < size && header < pos + SCAN_MAX_HEADER && data[ header ] ) header++;
+                if ( header + 1 < size && data[ header ] == 0 && data[ header + 1 ] == 0x66 ) body = header + 2;
+            }
+            break;
+        case 0x55: // Headerless SYSTEM
+            if ( pos + 8 < size && data[ pos + 7 ] == 0x3C ) {
+                int printable = data[ pos + 1 ] > 0x20 && data[ pos + 1 ] <= 0x7E; // The name can be padded by 0x00
+                for( int i = 2; i <= 6; i++ ) {
+                    if ( data[ pos + i ] ? data[ pos + i ] < 0x20 || data[ pos + i ] > 0x7E || !data[ pos + i - 1 ] : 0 ) printable = 0;
+                }
+                if ( printable ) body = pos;
+            }
+            break;
+    }
+    if ( body && ( end = scan_body_size( data, size, body ) ) ) {
+        if ( !( chunk->count & 0xFF ) ) chunk->hits = realloc( chunk->hits, ( chunk->count + 0x100 ) * sizeof( struct scan_hit ) );
+        chunk->hits[ chunk->count ].offset = offset;
+        chunk->hits[ chunk->count ].body = body;
+        chunk->hits[ chunk->count++ ].end = end;
+    }
+}
+
+static void *scan_chunk( void *arg ) {
+    struct scan_chunk *chunk = arg;
+    const unsigned char *data = chunk->data;
+    size_t pos = chunk->from;
+#ifdef __SSE2__
+    const __m128i aa = _mm_set1_epi8( 0x66 ), a5 = _mm_set1_epi8( (char)0xA5 ), c = _mm_set1_epi8( 'C' ), x55 = _mm_set1_epi8( 0x55 );
+    for( ; pos + 16 <= chunk->to; pos += 16 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i*)( data + pos ) );
+        __m128i hit = _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( v, aa ), _mm_cmpeq_epi8( v, a5 ) ),
+                                    _mm_or_si128( _mm_cmpeq_epi8( v, c ), _mm_cmpeq_epi8( v, x55 ) ) );
+        unsigned int mask = _mm_movemask_epi8( hit );
+        while ( mask ) {
+            scan_candidate( chunk, pos + __builtin_ctz( mask ) );
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for( ; pos < chunk->to; pos++ ) {
+        unsigned char byte = data[ pos ];
+        if ( byte == 0x66 || byte == 0xA5 || byte == 'C' || byte == 0x55 ) scan_candidate( chunk, pos );
+    }
+    return 0;
+}
+
+static int compare_hits( const void *a, const void *b ) {
+    const struct scan_hit *x = a, *y = b;
+    if ( x->body != y->body ) return x->body < y->body ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static void scan_file( FILE *cas, const char *outDir ) {
+    struct stat st;
+    int fd = fileno( cas );
+    if ( fstat( fd, &st ) || !S_ISREG( st.st_mode ) || !st.st_size ) {
+        fprintf( stderr, "The scan needs a regular, not empty file\n" );
+        exit(1);
+    }
+    const unsigned char *data = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( data == MAP_FAILED ) {
+        fprintf( stderr, "Error mapping the input file\n" );
+        exit(1);
+    }
+    madvise( (void*)data, st.st_size, MADV_SEQUENTIAL );
+    int threads = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( threads < 1 ) threads = 1;
+    struct scan_chunk chunks[ threads ];
+    size_t chunkSize = ( st.st_size / threads + 15 ) & ~(size_t)15;
+    for( int i = 0; i < threads; i++ ) {
+        chunks[ i ].data = data;
+        chunks[ i ].size = st.st_size;
+        chunks[ i ].from = i * chunkSize < st.st_size ? i * chunkSize : st.st_size;
+        chunks[ i ].to = ( i + 1 ) * chunkSize < st.st_size ? ( i + 1 ) * chunkSize : st.st_size;
+        chunks[ i ].hits = 0;
+        chunks[ i ].count = 0;
+        pthread_create( &chunks[ i ].thread, 0, scan_chunk, &chunks[ i ] );
+    }
+    int count = 0;
+    struct scan_hit *hits = 0;
+    for( int i = 0; i < threads; i++ ) {
+        pthread_join( chunks[ i ].thread, 0 );
+        hits = realloc( hits, ( count + chunks[ i ].count + 1 ) * sizeof( struct scan_hit ) );
+        memcpy( hits + count, chunks[ i ].hits, chunks[ i ].count * sizeof( struct scan_hit ) );
+        count += chunks[ i ].count;
+        free( chunks[ i ].hits );
+    }
+    qsort( hits, count, sizeof( struct scan_hit ), compare_hits );
+    // A hit inside an extracted tape (same body with other anchor, or a signature in the data) is dropped
+    size_t lastEnd = 0;
+    int extracted = 0;
+    for( int i = 0; i < count; i++ ) {
+        struct scan_hit *hit = &hits[ i ];
+        if ( hit->body < lastEnd ) continue;
+        char name[ 4096 ];
+        snprintf( name, sizeof( name ), "%s/hit_%08llx.tap", outDir, (unsigned long long)hit->offset );
+        FILE *tap = fopen( name, "wb" );
+        if ( !tap ) {
+            fprintf( stderr, "Error creating %s.\n", name );
+            exit(4);
+        }
+        write_leading( tap );
+        fwrite( data + hit->body, 1, hit->end - hit->body, tap );
+        fclose( tap );
+        if ( data[ hit->body ] == 0x55 ) {
+            fprintf( stdout, "0x%08llX: SYSTEM '%.6s', %llu bytes -> %s\n", (unsigned long long)hit->offset, data + hit->body + 1, (unsigned long long)( hit->end - hit->body ), name );
+        } else {
+            fprintf( stdout, "0x%08llX: BASIC, %llu bytes -> %s\n", (unsigned long long)hit->offset, (unsigned long long)( hit->end - hit->body ), name );
+        }
+        lastEnd = hit->end;
+        extracted++;
+    }
+    fprintf( stdout, "%d tapes found in %lld bytes\n", extracted, (long long)st.st_size );
+    free( hits );
+    munmap( (void*)data, st.st_size );
+    fclose( cas );
+}
+
+static void test_cas_file( FILE *cas, FILE *tap ) {
+    if ( !tap || body_only || imageName || !copy_canonical_tap( cas, tap ) ) {
+        test_header( cas, tap );
+        test_cas_body( cas, tap );
+    }
     fclose( cas );
     if ( tap ) fclose( tap );
+    if ( imageName ) write_memory_image(); // Only after the checks of the whole tape
 }
 
-void print_usage() {
+static void print_usage() {
     printf( "cas2tap v%d.%d%c (build: %s)\n", VM, VS, VB, __DATE__ );
     printf( "Test and convert Colour Genie and TRS-80 CAS, cgt or binary tap file to binary tap.\n");
     printf( "Copyright 2022 by László Princz\n");
@@ -317,6 +684,8 @@ void print_usage() {
     printf( "Command line option:\n");
     printf( "-b            : body only, leave leading (for test only)\n");
     printf( "-r <new_name> : rename programfile\n");
+    printf( "-m <image>    : export memory image (load map, entry and memory) for instant load\n");
+    printf( "-s <dir>      : scan the input for tapes, and extract them to <dir>/hit_<offset>.tap\n");
     exit(1);
 }
 
@@ -324,8 +693,9 @@ int main(int argc, char *argv[]) {
     int opt = 0;
     FILE *casFile = 0;
     FILE *tapFile = 0;
+    char *scanDir = 0;
 
-    while ( ( opt = getopt (argc, argv, "b?h:i:r:o:") ) != -1 ) {
+    while ( ( opt = getopt (argc, argv, "b?h:i:r:o:m:s:") ) != -1 ) {
         switch ( opt ) {
             case -1:
             case ':':
@@ -352,12 +722,20 @@ int main(int argc, char *argv[]) {
                     exit(4);
                 }
                 break;
+            case 'm': // create memory image file
+                imageName = optarg;
+                break;
+            case 's': // scan mode
+                scanDir = optarg;
+                break;
             default:
                 break;
         }
     }
 
-    if ( casFile ) {
+    if ( casFile && scanDir ) {
+        scan_file( casFile, scanDir );
+    } else if ( casFile ) {
         test_cas_file( casFile, tapFile );
         fprintf( stdout, "Ok\n" );
     } else {
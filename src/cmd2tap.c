@@ -15,17 +15,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include "getopt.h"
+#include "memimage.h"
 #include <libgen.h>
 
 #define VM 0
 #define VS 4
 #define VB 'b'
 
-int verbose = 0;
-char system_name[ 7 ] = { 0,0,0,0,0,0,0 }; // Name for SYSTEM tape, if Cmd format not includes program name.
-int system_name_position = 0; // If it is not 0, then program name already writed.
+static int verbose = 0;
+static char system_name[ 7 ] = { 0,0,0,0,0,0,0 }; // Name for SYSTEM tape, if Cmd format not includes program name.
+static int system_name_position = 0; // If it is not 0, then program name already writed.
 
-void fblockread( void *bytes, size_t size, FILE *src ) {
+static void fblockread( void *bytes, size_t size, FILE *src ) {
     int pos = ftell( src );
     while ( ( fread( bytes, size, 1, src ) != 1 ) && ( !feof( src ) ) ) fseek( src, pos, SEEK_SET );
     if ( feof( src ) ) {
@@ -34,13 +35,13 @@ void fblockread( void *bytes, size_t size, FILE *src ) {
     }
 }
 
-void write_leader( FILE *tap ) {
+static void write_leader( FILE *tap ) {
     unsigned char bytes[] = { 0xAA, 0x66 };
     for( int i=0; i<255; i++ ) fwrite( &bytes[0], 1, 1, tap );
     fwrite( &bytes[1], 1, 1, tap );
 }
 
-int write_system_filename_block( FILE *tap ) {
+static int write_system_filename_block( FILE *tap ) {
     if ( system_name[ 0 ] ) { // Name from program option
         unsigned char byte = 0x55;
         fwrite( &byte, 1, 1, tap ); // record type: 0x55
@@ -54,7 +55,7 @@ int write_system_filename_block( FILE *tap ) {
     }
 }
 
-void write_system_data_block( FILE *cmd, FILE *tap, int address, int counter ) {
+static void write_system_data_block( FILE *cmd, FILE *tap, int address, int counter ) {
     unsigned char byte = 0x3C;
     fwrite( &byte, 1, 1, tap ); // record type: 0x3C
 
@@ -75,23 +76,26 @@ void write_system_data_block( FILE *cmd, FILE *tap, int address, int counter ) {
         byte = fgetc( cmd );
         fwrite( &byte, 1, 1, tap );
         checksum += byte;
+        memory[ ( address + cnt ) & 0xFFFF ] = byte;
     }
     if ( cnt == counter ) {
         fwrite( &checksum, 1, 1, tap );
+        if ( imageName ) image_region( address, counter );
     } else {
         fprintf( stdout, "object record write error.\n" );
         exit(1);
     }
 }
 
-void write_system_entry_block( FILE *tap, int address ) {
+static void write_system_entry_block( FILE *tap, int address ) {
     unsigned char byte = 0x78;
     fwrite( &byte, 1, 1, tap ); // record type: 0x78
     fwrite( &address, 1, 2, tap );
+    image.entry = address;
     fprintf( stdout, "SYSTEM entry point: '%04X'\n", address );
 }
 
-int write_tap_header( FILE *tap ) {
+static int write_tap_header( FILE *tap ) {
     write_leader( tap );
     return write_system_filename_block( tap );
 }
@@ -99,7 +103,7 @@ int write_tap_header( FILE *tap ) {
 // Record Type 05 – Filename
 //    05 nn xx yy zz …
 //    nn = length of the filename block followed by the applicable data.
-void convert_filename_record( FILE *cmd, FILE *tap ) {
+static void convert_filename_record( FILE *cmd, FILE *tap ) {
     unsigned char nn = fgetc( cmd );
     unsigned char filename[ nn+1 ];
     fblockread( &filename, nn, cmd );
@@ -113,7 +117,7 @@ void convert_filename_record( FILE *cmd, FILE *tap ) {
 //
 //    For example, A 01 02 00 6E xx yy zz would mean to set up the load block, indicate that the address for the block is 6E00, and that 256 bytes will follow.
 //    Another example, A 01 01 00 6E xx yy zz would mean to set up the load block, indicate that the address for the block is 6E00, and that 255 bytes will follow.
-void convert_load_record( FILE *cmd, FILE *tap, unsigned char sizeByte, int address, int pos ) {
+static void convert_load_record( FILE *cmd, FILE *tap, unsigned char sizeByte, int address, int pos ) {
     int size = sizeByte ? sizeByte : 256;
     write_system_data_block( cmd, tap, address, size ); // Copy size bytes from cmd to tap
     if ( verbose ) fprintf( stdout, "%d object bytes converted to 0x%04X from 0x%06X\n", size, address, pos );
@@ -121,7 +125,7 @@ void convert_load_record( FILE *cmd, FILE *tap, unsigned char sizeByte, int addr
 
 //Record Type 02  - Last block is only 4 bytes!
 // Ignore the size byte value. Ignore all bytes after last block
-void convert_last_record( FILE *cmd, FILE *tap, unsigned char sizeByte, int address, int pos ) {
+static void convert_last_record( FILE *cmd, FILE *tap, unsigned char sizeByte, int address, int pos ) {
     unsigned char byte; // tmp byte variable
     write_system_entry_block( tap, address );
 /*
@@ -140,7 +144,7 @@ void convert_last_record( FILE *cmd, FILE *tap, unsigned char sizeByte, int addr
 //Record Type other – Comment
 //    xx nn …
 //    nn = length of the block
-void convert_comment_record( FILE *cmd ) {
+static void convert_comment_record( FILE *cmd ) {
     unsigned char byte; // tmp byte variable
     unsigned char size = fgetc( cmd );
     for( int i=0; i<size; i++ ) {
@@ -155,7 +159,7 @@ void convert_comment_record( FILE *cmd ) {
  * 2 - last block
  * 3 - ignore block
  */
-void convert_system( unsigned char recordType, FILE *cmd, FILE *tap ) {
+static void convert_system( unsigned char recordType, FILE *cmd, FILE *tap ) {
     int finished = 0;
     while ( !finished && !feof( cmd ) ) {
         int pos = ftell( cmd ) -1; // Block start pos
@@ -193,12 +197,12 @@ void convert_system( unsigned char recordType, FILE *cmd, FILE *tap ) {
     }
 }
 
-void convert_basic( FILE *cmd, FILE *tap ) {
+static void convert_basic( FILE *cmd, FILE *tap ) {
     fprintf( stderr, "Basic CMD conversion not implemented yet\n" );
     exit( 1 );
 }
 
-void convert( FILE *cmd, FILE *tap ) {
+static void convert( FILE *cmd, FILE *tap ) {
     unsigned char byte = fgetc( cmd ); // tmp byte variable
     if ( !feof( cmd ) ) { // Ok, there is data
         if ( byte == 0xFF ) {
@@ -212,9 +216,13 @@ void convert( FILE *cmd, FILE *tap ) {
     }
     fclose( cmd );
     fclose( tap );
+    if ( imageName ) {
+        memcpy( image.name, system_name, 6 );
+        write_memory_image();
+    }
 }
 
-void print_usage() {
+static void print_usage() {
     printf( "cmd2tap v%d.%d%c (build: %s)\n", VM, VS, VB, __DATE__ );
     printf( "Convert Colour Genie cmd file to binary tap format.\n");
     printf( "Copyright 2022 by László Princz\n");
@@ -223,16 +231,17 @@ void print_usage() {
     printf( "Command line option:\n");
     printf( "-n <name> : Programname. Default the filename.\n");
     printf( "-v        : Verbose mode. Default the non-verbose mode.\n");
+    printf( "-m <image>: Export memory image (load map, entry and memory) for instant load.\n");
     exit(1);
 }
 
-void copy_to_name( char* basename ) {
+static void copy_to_name( char* basename ) {
     int i = 0;
     for( i = 0; i<6 && basename[ i ]; i++ ) system_name[ i ] = basename[ i ];
     for( int j = i; j < 7; j++ ) system_name[ j ] = 0;
 }
 
-char* copyStr( char *str, int chunkPos ) {
+static char* copyStr( char *str, int chunkPos ) {
     int size = 0;
     while( str[size++] );
     char *newStr = malloc( size );
@@ -243,7 +252,7 @@ char* copyStr( char *str, int chunkPos ) {
     return newStr;
 }
 
-char* copyStr3( char *str1, char *str2, char *str3 ) {
+static char* copyStr3( char *str1, char *str2, char *str3 ) {
     int size1 = 0; while( str1[size1++] );
     int size2 = 0; while( str2[size2++] );
     size2--;
@@ -256,7 +265,7 @@ char* copyStr3( char *str1, char *str2, char *str3 ) {
     return newStr;
 }
 
-int is_dir( const char *path ) {
+static int is_dir( const char *path ) {
     struct stat path_stat;
     stat( path, &path_stat );
     return S_ISDIR( path_stat.st_mode );
@@ -269,7 +278,7 @@ int main(int argc, char *argv[]) {
     FILE *cmdFile = 0;
     FILE *tapFile = 0;
 
-    while ( ( opt = getopt (argc, argv, "v?h:i:o:n:") ) != -1 ) {
+    while ( ( opt = getopt (argc, argv, "v?h:i:o:n:m:") ) != -1 ) {
         switch ( opt ) {
             case -1:
             case ':':
@@ -303,6 +312,9 @@ int main(int argc, char *argv[]) {
                     }
                 }
                 break;
+            case 'm': // create memory image file
+                imageName = optarg;
+                break;
             default:
                 break;
         }
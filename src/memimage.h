@@ -0,0 +1,77 @@
+/**
+ * Memory image export for the emulators (cas2tap -m, cmd2tap -m): the memory after the load, without the tape playback.
+ * Image file: header, load map (loaded regions), fixups (pointer writes of the ROM), and the flat memory
+ * from the first to the last loaded address. All values are little endian.
+ * The tool fills the memory, the load map with image_region(), the fixups and the header fields, then calls write_memory_image().
+ */
+#ifndef MEMIMAGE_H
+#define MEMIMAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_REGIONS 512
+#define MAX_FIXUPS 4
+
+#pragma pack(1)
+struct image_header {
+    char           magic[ 4 ];    // "CGMI"
+    unsigned char  version;       // 1
+    unsigned char  type;          // 0 - SYSTEM, 1 - BASIC
+    unsigned short entry;         // SYSTEM entry point, 0 for BASIC
+    char           name[ 6 ];
+    unsigned short regionCount;   // Load map entries: unsigned short address, unsigned short size
+    unsigned short fixupCount;    // Fixup entries: unsigned short address, unsigned short value
+    unsigned short start;         // Address of the first byte of the flat memory
+    unsigned int   length;        // Size of the flat memory
+};
+#pragma pack()
+
+static char *imageName = 0; // The memory image is created only after the checks
+static unsigned char memory[ 0x10000 ];
+static unsigned short regions[ MAX_REGIONS ][ 2 ]; // address, size
+static unsigned short fixups[ MAX_FIXUPS ][ 2 ];   // address, value
+static int regionCount = 0, fixupCount = 0;
+static struct image_header image = { { 'C','G','M','I' }, 1 };
+
+// Adds a loaded block to the load map. The continuous blocks are merged.
+static void image_region( unsigned int address, unsigned int size ) {
+    if ( regionCount && regions[ regionCount - 1 ][ 0 ] + regions[ regionCount - 1 ][ 1 ] == address && regions[ regionCount - 1 ][ 1 ] + size < 0x10000 ) {
+        regions[ regionCount - 1 ][ 1 ] += size;
+    } else if ( regionCount < MAX_REGIONS ) {
+        regions[ regionCount ][ 0 ] = address;
+        regions[ regionCount++ ][ 1 ] = size;
+    } else {
+        fprintf( stderr, "Too many regions in the memory image\n" );
+        exit(1);
+    }
+}
+
+static void write_memory_image() {
+    unsigned int start = 0xFFFF, end = 0;
+    for( int i = 0; i < regionCount; i++ ) {
+        if ( regions[ i ][ 0 ] < start ) start = regions[ i ][ 0 ];
+        if ( regions[ i ][ 0 ] + regions[ i ][ 1 ] > end ) end = regions[ i ][ 0 ] + regions[ i ][ 1 ];
+    }
+    if ( !regionCount || end > 0x10000 ) {
+        fprintf( stderr, "No loadable data for the memory image\n" );
+        exit(1);
+    }
+    image.regionCount = regionCount;
+    image.fixupCount = fixupCount;
+    image.start = start;
+    image.length = end - start;
+    FILE *img = fopen( imageName, "wb" );
+    if ( !img ) {
+        fprintf( stderr, "Error creating %s.\n", imageName );
+        exit(4);
+    }
+    fwrite( &image, sizeof( image ), 1, img );
+    fwrite( regions, 4, regionCount, img );
+    fwrite( fixups, 4, fixupCount, img );
+    fwrite( memory + start, 1, end - start, img );
+    fprintf( stdout, "Memory image: 0x%04X-0x%04X, %d regions, entry 0x%04X\n", start, end - 1, regionCount, image.entry );
+    fclose( img );
+}
+
+#endif
@@ -4,6 +4,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
 #include "getopt.h"
 
 #define VM 0
@@ -50,8 +60,67 @@ struct wav_header {
     'd','a','t','a', //     Sub Chunk2 ID - konstans, 4 byte hosszú, értéke 0x64617461, ASCII kódban "data"
     0                //     Sub Chunk2 Size - 4 byte hosszú, az adatblokk méretét tartalmazza bájtokban, értéke 0x01D61A1E
 };
+
+/* CSW v2 file header structure */
+struct csw_header {
+    char           signature[ 22 ]; // "Compressed Square Wave"
+    unsigned char  terminator;      // 0x1A
+    unsigned char  major;           // 2
+    unsigned char  minor;           // 0
+    unsigned int   sampleRate;      // Pulse lengths are counted in samples of this rate
+    unsigned int   pulseCount;      // Total number of pulses after decompression
+    unsigned char  compression;     // 1 - RLE, 2 - Z-RLE
+    unsigned char  flags;           // bit 0 : initial polarity
+    unsigned char  extLen;          // Header extension length
+    char           encoder[ 16 ];   // Encoding application description
+} csw = {
+    { 'C','o','m','p','r','e','s','s','e','d',' ','S','q','u','a','r','e',' ','W','a','v','e' },
+    0x1A,
+    2,
+    0,
+    44100,
+    0,
+    1,
+    0,                               // The lead in silence is the low level
+    0,
+    "tap2wav"
+};
+
+/* RF64 header prefix (EBU Tech 3306) for the wav files over 4 GB. The wave header follows it from the fmt chunk. */
+struct rf64_header {
+    char               rf64[ 4 ];     // "RF64"
+    unsigned int       rLen;          // 0xFFFFFFFF, the size is in the ds64 chunk
+    char               WAVE[ 4 ];     // "WAVE"
+    char               ds64[ 4 ];     // "ds64"
+    unsigned int       dsLen;         // 28
+    unsigned long long riffSize;      // File size - 8
+    unsigned long long dataSize;      // Size of the data chunk
+    unsigned long long sampleCount;
+    unsigned int       tableLength;   // 0
+} rf64 = {
+    'R','F','6','4',
+    0xFFFFFFFF,
+    'W','A','V','E',
+    'd','s','6','4',
+    28,
+    0,
+    0,
+    0,
+    0
+};
 #pragma pack()
 
+#define RF64_HEADER_SIZE ( sizeof( rf64 ) + sizeof( wave ) - 12 )
+static int rf64Mode = 0; // 1 - the data is over the RIFF limit
+
+static int cswMode = 0; // 0 - wav output, 1 - CSW RLE output, 2 - CSW Z-RLE output
+static unsigned int   csw_pulse_len = 0;   // Length of the pending (not yet written) pulse
+static unsigned char  csw_pulse_level = 0; // Input level of the pending pulse
+static z_stream       csw_zstream;
+#define CSW_RATE 96000 // The pulse lengths are rounded at this rate, independent of the wav rate
+static double         csw_clock = 0;       // Exact end of the last bit cell, in CSW samples
+static long long      csw_edge = 0;        // Rounded end of the last bit cell
+
 static unsigned char    p_gain = 6 * 0x0f;
 const unsigned char     p_silence = 0;
 static unsigned int     wav_sample_count = 0;
@@ -59,11 +128,25 @@ static unsigned char    level; // 0 vagy 1?
 
 static unsigned int wav_baud = defaultBaud;
 
+/* Filter state */
+#define LP_COEF 0.5577
+#define HP_COEF 0.0070984
+static double hp_accu = 0, lp_accu = 0;
+
+/* Random access rendering: only the samples in the [render_start, render_end) window are written */
+static long long render_pos = 0;    // Index of the next sample
+static long long render_start = 0;
+static long long render_end = -1;   // -1 : to the end
+static int       count_only = 0;    // Only counts the samples, for the block positions
+static int       first_block = -1, last_block = -1; // Rendered tap block range
+static long long *block_samples = 0; // The first sample of the tap blocks
+static int       block_count = 0;
+static long long tape_samples = -1; // Samples of the whole tape, -1 if not counted
+
 static double bauds_to_samples( unsigned int bauds ) { return ( (double)wave.nSamplesPerSec / bauds ); }
 static unsigned int cycles_to_samples( unsigned int cycles ) { return ( cycles * wave.nSamplesPerSec) / 2216750; }
 
-static void filter_output( unsigned char level, FILE *wavfile ) {
-    static double hp_accu = 0, lp_accu = 0;
+static unsigned char filter_sample( unsigned char level ) {
     double in = level * 1.0;
     double clipped = lp_accu - hp_accu;
     unsigned char out;
@@ -75,37 +158,752 @@ static void filter_output( unsigned char level, FILE *wavfile ) {
     }
 
     out = ((unsigned char)(clipped)) ^ 0x80;
-    lp_accu += ((double)in - lp_accu) * 0.5577;
-    hp_accu += (lp_accu - hp_accu) * 0.0070984;
-    fputc( out, wavfile);
+    lp_accu += ((double)in - lp_accu) * LP_COEF;
+    hp_accu += (lp_accu - hp_accu) * HP_COEF;
+    return out;
+}
+
+
+/**
+ * Specialized render kernels for the supported sample rates and the 1150 and 2900 baud.
+ * A kernel renders a run with constant length: the bit period or half period of a configuration.
+ * In a constant input run the filter state is in closed form (see skip_filter), so the samples are
+ * independent of each other, and the compiler unrolls and vectorizes the fixed length loop:
+ * lp(j) - hp(j) = ( lp0 - u ) * C(j) - ( hp0 - u ) * b^j
+ * The input is max 8 * 0x0f < 127, so the filter output never clipped, and the kernels not check it.
+ * The kernels selected by the run length from the dispatch table, the other runs rendered by the generic filter.
+ */
+#define KERNEL_MAX_RUN 64
+
+typedef void ( *render_kernel )( unsigned char *out, double in );
+
+static double kernel_a[ KERNEL_MAX_RUN + 1 ]; // a^j
+static double kernel_b[ KERNEL_MAX_RUN + 1 ]; // b^j
+static double kernel_c[ KERNEL_MAX_RUN + 1 ]; // a^j - K * ( b^j - a^j )
+static double kernel_k;                       // K = HP_COEF * a / ( b - a )
+
+static inline __attribute__((always_inline)) void render_fixed( unsigned char *out, const unsigned int n, double in ) {
+    double d = lp_accu - in, e = hp_accu - in;
+#pragma GCC unroll 64
+    for( unsigned int j = 0; j < n; j++ ) {
+        out[ j ] = ((unsigned char)(int)( d * kernel_c[ j ] - e * kernel_b[ j ] )) ^ 0x80;
+    }
+    lp_accu = in + kernel_a[ n ] * d;
+    hp_accu = in + kernel_b[ n ] * e + kernel_k * ( kernel_b[ n ] - kernel_a[ n ] ) * d;
+}
+
+#define KERNEL_LENGTHS( X ) X( 1 ) X( 2 ) X( 3 ) X( 4 ) X( 6 ) X( 7 ) X( 8 ) X( 9 ) X( 15 ) X( 16 ) X( 19 ) X( 20 ) X( 38 ) X( 41 )
+#define DEFINE_KERNEL( N ) static void render_run_##N( unsigned char *out, double in ) { render_fixed( out, N, in ); }
+KERNEL_LENGTHS( DEFINE_KERNEL )
+
+/* Bit period and half period of the configurations: (unsigned int)( rate / baud / ( bit + 1 ) ) */
+static const struct kernel_set {
+    unsigned int  rate;
+    unsigned int  baud;
+    unsigned int  period, halfPeriod;
+    render_kernel full, half;
+} kernel_sets[] = {
+    {  8000, 1150,  6,  3, render_run_6,  render_run_3 },
+    { 11025, 1150,  9,  4, render_run_9,  render_run_4 },
+    { 22050, 1150, 19,  9, render_run_19, render_run_9 },
+    { 44100, 1150, 38, 19, render_run_38, render_run_19 },
+    { 48000, 1150, 41, 20, render_run_41, render_run_20 },
+    {  8000, 2900,  2,  1, render_run_2,  render_run_1 },
+    { 11025, 2900,  3,  1, render_run_3,  render_run_1 },
+    { 22050, 2900,  7,  3, render_run_7,  render_run_3 },
+    { 44100, 2900, 15,  7, render_run_15, render_run_7 },
+    { 48000, 2900, 16,  8, render_run_16, render_run_8 },
+};
+
+static int kernelMode = 1; // 0 - generic filter only
+static int benchMode = 0;  // 1 - the runs are captured for the benchmark
+static struct run_list {
+    unsigned int  *samples;
+    unsigned char *levels;
+    long count;
+    long total;
+} bench_runs;
+static render_kernel run_kernels[ KERNEL_MAX_RUN ]; // Dispatch table by run length
+
+// Fills the dispatch table for the sample rate
+static void init_kernels() {
+    const double a = 1.0 - LP_COEF, b = 1.0 - HP_COEF;
+    kernel_k = HP_COEF * a / ( b - a );
+    for( int j = 0; j <= KERNEL_MAX_RUN; j++ ) {
+        kernel_a[ j ] = pow( a, j );
+        kernel_b[ j ] = pow( b, j );
+        kernel_c[ j ] = kernel_a[ j ] - kernel_k * ( kernel_b[ j ] - kernel_a[ j ] );
+    }
+    memset( run_kernels, 0, sizeof( run_kernels ) );
+    if ( !kernelMode || p_gain >= 127 ) return;
+    for( int i = 0; i < sizeof( kernel_sets ) / sizeof( kernel_sets[ 0 ] ); i++ ) {
+        const struct kernel_set *k = &kernel_sets[ i ];
+        if ( k->rate == wave.nSamplesPerSec ) {
+            run_kernels[ k->period ] = k->full;
+            run_kernels[ k->halfPeriod ] = k->half;
+        }
+    }
+}
+
+static void render_samples( unsigned char *out, unsigned int n, unsigned char in ) {
+    if ( n < KERNEL_MAX_RUN && run_kernels[ n ] ) {
+        run_kernels[ n ]( out, in );
+    } else {
+        for( unsigned int j = 0; j < n; j++ ) out[ j ] = filter_sample( in );
+    }
+}
+
+static void filter_output( unsigned char level, FILE *wavfile ) {
+    fputc( filter_sample( level ), wavfile );
+}
+
+static void csw_write( FILE *cswfile, unsigned char *bytes, unsigned int size ) {
+    if ( cswMode == 2 ) {
+        unsigned char zbuf[ 1024 ];
+        csw_zstream.next_in = bytes;
+        csw_zstream.avail_in = size;
+        do {
+            csw_zstream.next_out = zbuf;
+            csw_zstream.avail_out = sizeof( zbuf );
+            deflate( &csw_zstream, size ? Z_NO_FLUSH : Z_FINISH );
+            fwrite( zbuf, 1, sizeof( zbuf ) - csw_zstream.avail_out, cswfile );
+        } while ( csw_zstream.avail_out == 0 );
+    } else {
+        fwrite( bytes, 1, size, cswfile );
+    }
+}
+
+// Write the pending pulse. Pulses longer than 255 samples stored as 0x00 + 4 bytes length
+static void csw_flush_pulse( FILE *cswfile ) {
+    if ( csw_pulse_len ) {
+        unsigned char rle[ 5 ] = { 0, csw_pulse_len, csw_pulse_len >> 8, csw_pulse_len >> 16, csw_pulse_len >> 24 };
+        if ( csw_pulse_len < 256 ) {
+            csw_write( cswfile, &rle[ 1 ], 1 );
+        } else {
+            csw_write( cswfile, rle, 5 );
+        }
+        csw.pulseCount++;
+        csw_pulse_len = 0;
+    }
+}
+
+// The CSW pulse is the time between two polarity changes, so the runs with same level are merged
+static void csw_output( unsigned char in, unsigned int samples, FILE *cswfile ) {
+    if ( csw_pulse_len && csw_pulse_level != in ) csw_flush_pulse( cswfile );
+    csw_pulse_level = in;
+    csw_pulse_len += samples;
+}
+
+/**
+ * The filter state after samples with constant input, without rendering them.
+ * The filter is linear (the clipping only on the output), so the state is in closed form:
+ * lp(n) = u + a^n * (lp0 - u)
+ * hp(n) = u + b^n * (hp0 - u) + (1-b) * a * (b^n - a^n) / (b - a) * (lp0 - u)
+ * where a = 1 - LP_COEF, b = 1 - HP_COEF
+ */
+static void skip_filter( unsigned char level, unsigned int samples ) {
+    const double a = 1.0 - LP_COEF, b = 1.0 - HP_COEF;
+    double u = level * 1.0;
+    double an = pow( a, samples ), bn = pow( b, samples );
+    double d = lp_accu - u;
+    hp_accu = u + bn * ( hp_accu - u ) + HP_COEF * a * ( bn - an ) / ( b - a ) * d;
+    lp_accu = u + an * d;
+}
+
+/**
+ * Byte transitions for the seek before the window and for the sample counting. A byte is a fixed sequence of runs,
+ * so the filter state after it is the state rendered from the zero state plus the zero input response of the start
+ * state (see skip_filter). The tables are built at the first use of a baud, the turbo mode uses two bauds.
+ */
+#define SKIP_TABLES 2
+
+static struct skip_table {
+    unsigned int baud;                     // 0 - unused
+    unsigned int samples[ 2 ][ 256 ];      // By start level and byte
+    double       lp[ 2 ][ 256 ], hp[ 2 ][ 256 ]; // Filter state after the byte from the zero state
+    double       an[ 2 ][ 256 ], bn[ 2 ][ 256 ]; // a^n and b^n for the sample count
+} skip_tables[ SKIP_TABLES ];
+static int nextSkipTable = 0;
+
+static struct skip_table *get_skip_table( unsigned int baud ) {
+    for( int i = 0; i < SKIP_TABLES; i++ ) if ( skip_tables[ i ].baud == baud ) return &skip_tables[ i ];
+    const double a = 1.0 - LP_COEF, b = 1.0 - HP_COEF;
+    struct skip_table *t = &skip_tables[ nextSkipTable ];
+    nextSkipTable = ( nextSkipTable + 1 ) % SKIP_TABLES;
+    double savedLp = lp_accu, savedHp = hp_accu;
+    for( int start = 0; start < 2; start++ ) {
+        for( int byte = 0; byte < 256; byte++ ) {
+            unsigned char in = start;
+            unsigned int n = 0;
+            lp_accu = hp_accu = 0;
+            for( int bc = 7; bc >= 0; bc-- ) {
+                unsigned int bit = ( byte >> bc ) & 1;
+                unsigned int period = (unsigned int)( bauds_to_samples( baud ) / ( bit + 1 ) );
+                do {
+                    for( unsigned int j = 0; j < period; j++ ) filter_sample( in ? p_silence : p_gain );
+                    n += period;
+                    in ^= 1;
+                } while ( bit-- );
+            }
+            t->samples[ start ][ byte ] = n;
+            t->lp[ start ][ byte ] = lp_accu;
+            t->hp[ start ][ byte ] = hp_accu;
+            t->an[ start ][ byte ] = pow( a, n );
+            t->bn[ start ][ byte ] = pow( b, n );
+        }
+    }
+    lp_accu = savedLp;
+    hp_accu = savedHp;
+    t->baud = baud;
+    return t;
+}
+
+static void skip_byte( const struct skip_table *t, unsigned char byte, unsigned char start ) {
+    double an = t->an[ start ][ byte ], bn = t->bn[ start ][ byte ];
+    double lp = lp_accu, hp = hp_accu;
+    lp_accu = t->lp[ start ][ byte ] + an * lp;
+    hp_accu = t->hp[ start ][ byte ] + bn * hp + kernel_k * ( bn - an ) * lp;
+}
+
+
+/**
+ * Cache of the rendered bytes. A byte is 8 to 16 runs, and the tape has only 256 different bytes, so the waveforms
+ * are repeated. The key is the byte, the start level, the baud and the filter state, quantized by 1/CACHE_SCALE.
+ * A hit copies the samples rendered from the cached start state, and updates the exact filter state in closed form:
+ * the difference of the start states decays by the zero input response (see skip_filter).
+ * The samples of a hit differ from the exact ones by |d_lp| * |a^j - K * (b^j - a^j)| + |d_hp| * b^j < 2 / CACHE_SCALE = 1
+ * before the truncation, so at most by 1. The leader is a repeated byte, so after some bytes it is only copied.
+ */
+#define CACHE_SCALE 2.0
+#define CACHE_SLOTS 16384
+#define BYTE_MAX_SAMPLES 512
+
+struct byte_cache_entry {
+    int            used;
+    unsigned char  byte, start;
+    unsigned short baud;
+    int            lpKey, hpKey;
+    double         lp0, hp0;      // Filter state before the byte
+    double         lp1, hp1;      // Filter state after the byte
+    unsigned int   size;
+    unsigned char  samples[ BYTE_MAX_SAMPLES ];
+};
+
+static int cacheMode = 0; // 0 - exact mode, every byte rendered by the filter, 1 - byte cache
+static struct byte_cache_entry *byte_cache = 0;
+static double cache_a[ BYTE_MAX_SAMPLES + 1 ]; // a^n
+static double cache_b[ BYTE_MAX_SAMPLES + 1 ]; // b^n
+static long cacheHits = 0, cacheMisses = 0;
+
+static void init_byte_cache() {
+    const double a = 1.0 - LP_COEF, b = 1.0 - HP_COEF;
+    for( int j = 0; j <= BYTE_MAX_SAMPLES; j++ ) {
+        cache_a[ j ] = pow( a, j );
+        cache_b[ j ] = pow( b, j );
+    }
+    byte_cache = calloc( CACHE_SLOTS, sizeof( struct byte_cache_entry ) );
+}
+
+// Renders the runs of a byte from the current filter state. Returns the number of samples.
+static unsigned int render_byte_runs( unsigned char *out, unsigned char byte, unsigned char start, unsigned int baud ) {
+    unsigned int size = 0;
+    for( int bc = 7; bc >= 0; bc-- ) {
+        unsigned int bit = ( byte >> bc ) & 1;
+        unsigned int period = (unsigned int)( bauds_to_samples( baud ) / ( bit + 1 ) );
+        do {
+            render_samples( out + size, period, start ? p_silence : p_gain );
+            size += period;
+            start ^= 1;
+        } while ( bit-- );
+    }
+    return size;
+}
+
+// The byte fits into a cache entry
+static int cached_baud( unsigned int baud ) {
+    return byte_cache && baud && (unsigned int)bauds_to_samples( baud ) * 8 <= BYTE_MAX_SAMPLES;
+}
+
+// Renders a byte through the cache. The output must have space for BYTE_MAX_SAMPLES.
+static unsigned int render_byte( unsigned char *out, unsigned char byte, unsigned char start, unsigned int baud ) {
+    int lpKey = (int)lrint( lp_accu * CACHE_SCALE ), hpKey = (int)lrint( hp_accu * CACHE_SCALE );
+    unsigned int hash = ( ( byte * 2 + start ) * 31 + baud ) * 0x9E3779B1u ^ lpKey * 0x85EBCA6Bu ^ hpKey * 0xC2B2AE35u;
+    struct byte_cache_entry *entry = &byte_cache[ ( hash ^ hash >> 16 ) % CACHE_SLOTS ];
+    if ( entry->used && entry->byte == byte && entry->start == start && entry->baud == baud && entry->lpKey == lpKey && entry->hpKey == hpKey ) {
+        unsigned int n = entry->size;
+        double d = lp_accu - entry->lp0, e = hp_accu - entry->hp0;
+        memcpy( out, entry->samples, n );
+        lp_accu = entry->lp1 + cache_a[ n ] * d;
+        hp_accu = entry->hp1 + cache_b[ n ] * e + kernel_k * ( cache_b[ n ] - cache_a[ n ] ) * d;
+        cacheHits++;
+        return n;
+    }
+    entry->used = 1;
+    entry->byte = byte;
+    entry->start = start;
+    entry->baud = baud;
+    entry->lpKey = lpKey;
+    entry->hpKey = hpKey;
+    entry->lp0 = lp_accu;
+    entry->hp0 = hp_accu;
+    entry->size = render_byte_runs( entry->samples, byte, start, baud );
+    entry->lp1 = lp_accu;
+    entry->hp1 = hp_accu;
+    memcpy( out, entry->samples, entry->size );
+    cacheMisses++;
+    return entry->size;
+}
+
+static void print_cache_stats() {
+    if ( byte_cache ) fprintf( stdout, "Byte cache: %ld hits, %ld misses (%.1f%%), max sample error 1\n", cacheHits, cacheMisses, cacheHits + cacheMisses ? 100.0 * cacheHits / ( cacheHits + cacheMisses ) : 0.0 );
+}
+
+/**
+ * Asynchronous pipeline for the whole wav output.
+ * reader (convert) -> run buffers -> renderer (filter) -> sample buffers -> writer
+ * The writer is io_uring, if the kernel supports it, else a writer thread with pwrite.
+ * The buffers are written at file offsets, so the pipeline is used only for a regular output file.
+ * The buffers are recycled through the free queues, so there is no allocation in the steady state.
+ */
+#define RUN_BUFFERS 4
+#define RUN_BUFFER_SIZE 4096
+#define SAMPLE_BUFFERS 8
+#define SAMPLE_BUFFER_SIZE 65536
+#define QUEUE_SIZE 8
+
+struct run {
+    unsigned int   samples; // 0 - a whole byte, rendered by render_byte
+    unsigned char  level;   // Input level, or the byte
+    unsigned char  start;   // Start level of the byte
+    unsigned short baud;    // Baud of the byte
+};
+
+struct run_buffer {
+    int count;
+    int last;
+    struct run runs[ RUN_BUFFER_SIZE ];
+};
+
+struct sample_buffer {
+    int size;
+    int last;
+    long long offset;
+    unsigned char samples[ SAMPLE_BUFFER_SIZE ];
+};
+
+struct queue {
+    const char *name;
+    void *items[ QUEUE_SIZE ];
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    double popWaitMs;   // Consumer stall time
+    double pushWaitMs;  // Producer stall time
+    long pushes;
+    long depthSum;
+    int maxDepth;
+};
+
+static int pipelineMode = 1;  // 0 - synchronous output, 1 - pipeline, if possible, 2 - pipeline is running
+static int pipelineStats = 0;
+static int uringMode = 1;     // 0 - writer thread, 1 - io_uring, if possible
+static struct queue free_runs = { "free run buffers" }, full_runs = { "run buffers" };
+static struct queue free_samples = { "free sample buffers" }, full_samples = { "sample buffers" };
+static struct run_buffer *reader_buffer = 0;
+static int pipe_fd = -1;
+static long long pipe_offset = 0; // File position of the next sample buffer
+static double writeWaitMs = 0;    // Renderer stall time for the io_uring completions
+
+static struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    int inFlight;
+} ring = { -1 };
+
+static double now_ms() {
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static void queue_init( struct queue *q ) {
+    pthread_mutex_init( &q->lock, 0 );
+    pthread_cond_init( &q->changed, 0 );
+}
+
+static void queue_push( struct queue *q, void *item ) {
+    pthread_mutex_lock( &q->lock );
+    if ( q->count == QUEUE_SIZE ) {
+        double start = now_ms();
+        while ( q->count == QUEUE_SIZE ) pthread_cond_wait( &q->changed, &q->lock );
+        q->pushWaitMs += now_ms() - start;
+    }
+    q->items[ ( q->head + q->count++ ) % QUEUE_SIZE ] = item;
+    q->pushes++;
+    q->depthSum += q->count;
+    if ( q->count > q->maxDepth ) q->maxDepth = q->count;
+    pthread_cond_broadcast( &q->changed );
+    pthread_mutex_unlock( &q->lock );
+}
+
+static void *queue_pop( struct queue *q ) {
+    pthread_mutex_lock( &q->lock );
+    if ( !q->count ) {
+        double start = now_ms();
+        while ( !q->count ) pthread_cond_wait( &q->changed, &q->lock );
+        q->popWaitMs += now_ms() - start;
+    }
+    void *item = q->items[ q->head ];
+    q->head = ( q->head + 1 ) % QUEUE_SIZE;
+    q->count--;
+    pthread_cond_broadcast( &q->changed );
+    pthread_mutex_unlock( &q->lock );
+    return item;
+}
+
+// The kernel supports the IORING_OP_WRITE (from 5.6, like the probe)
+static int uring_write_supported( int fd ) {
+    size_t size = sizeof( struct io_uring_probe ) + 256 * sizeof( struct io_uring_probe_op );
+    struct io_uring_probe *probe = calloc( 1, size );
+    int supported = !syscall( __NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256 ) &&
+        probe->last_op >= IORING_OP_WRITE && ( probe->ops[ IORING_OP_WRITE ].flags & IO_URING_OP_SUPPORTED );
+    free( probe );
+    return supported;
+}
+
+// Raw io_uring setup, without liburing. Returns 0, if io_uring is not available.
+static int uring_init( unsigned entries ) {
+    struct io_uring_params p;
+    memset( &p, 0, sizeof( p ) );
+    ring.fd = syscall( __NR_io_uring_setup, entries, &p );
+    if ( ring.fd < 0 ) return 0;
+    if ( !uring_write_supported( ring.fd ) ) {
+        close( ring.fd );
+        ring.fd = -1;
+        return 0;
+    }
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    if ( p.features & IORING_FEAT_SINGLE_MMAP ) sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+    unsigned char *sq = mmap( 0, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING );
+    unsigned char *cq = ( p.features & IORING_FEAT_SINGLE_MMAP ) ? sq :
+        mmap( 0, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING );
+    ring.sqes = mmap( 0, p.sq_entries * sizeof( struct io_uring_sqe ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES );
+    if ( sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED ) {
+        close( ring.fd );
+        ring.fd = -1;
+        return 0;
+    }
+    ring.sq_tail = (unsigned*)( sq + p.sq_off.tail );
+    ring.sq_mask = (unsigned*)( sq + p.sq_off.ring_mask );
+    ring.sq_array = (unsigned*)( sq + p.sq_off.array );
+    ring.cq_head = (unsigned*)( cq + p.cq_off.head );
+    ring.cq_tail = (unsigned*)( cq + p.cq_off.tail );
+    ring.cq_mask = (unsigned*)( cq + p.cq_off.ring_mask );
+    ring.cqes = (struct io_uring_cqe*)( cq + p.cq_off.cqes );
+    return 1;
+}
+
+static void write_error() {
+    fprintf( stderr, "Wav file write error.\n" );
+    exit(1);
+}
+
+static void uring_submit( struct sample_buffer *buffer ) {
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[ index ];
+    memset( sqe, 0, sizeof( *sqe ) );
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = pipe_fd;
+    sqe->addr = (unsigned long)buffer->samples;
+    sqe->len = buffer->size;
+    sqe->off = buffer->offset;
+    sqe->user_data = (unsigned long)buffer;
+    ring.sq_array[ index ] = index;
+    __atomic_store_n( ring.sq_tail, tail + 1, __ATOMIC_RELEASE );
+    if ( syscall( __NR_io_uring_enter, ring.fd, 1, 0, 0, 0, 0 ) < 0 ) write_error();
+    ring.inFlight++;
+}
+
+// Waits one write completion, and returns its buffer
+static struct sample_buffer *uring_complete() {
+    unsigned head = *ring.cq_head;
+    if ( head == __atomic_load_n( ring.cq_tail, __ATOMIC_ACQUIRE ) ) {
+        double start = now_ms();
+        do {
+            if ( syscall( __NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0 ) < 0 ) write_error();
+        } while ( head == __atomic_load_n( ring.cq_tail, __ATOMIC_ACQUIRE ) );
+        writeWaitMs += now_ms() - start;
+    }
+    struct io_uring_cqe *cqe = &ring.cqes[ head & *ring.cq_mask ];
+    struct sample_buffer *buffer = (struct sample_buffer*)cqe->user_data;
+    int written = cqe->res;
+    __atomic_store_n( ring.cq_head, head + 1, __ATOMIC_RELEASE );
+    ring.inFlight--;
+    if ( written == -EINVAL ) written = 0; // Not supported write, the buffer written by pwrite
+    if ( written < 0 ) write_error();
+    if ( written < buffer->size && pwrite( pipe_fd, buffer->samples + written, buffer->size - written, buffer->offset + written ) != buffer->size - written ) write_error();
+    return buffer;
+}
+
+static struct sample_buffer *get_sample_buffer() {
+    if ( ring.fd >= 0 ) {
+        if ( free_samples.count ) return queue_pop( &free_samples );
+        return uring_complete();
+    }
+    return queue_pop( &free_samples );
+}
+
+static void put_sample_buffer( struct sample_buffer *buffer ) {
+    buffer->offset = pipe_offset;
+    pipe_offset += buffer->size;
+    if ( ring.fd >= 0 ) {
+        if ( buffer->size ) {
+            uring_submit( buffer );
+        } else {
+            queue_push( &free_samples, buffer );
+        }
+    } else {
+        queue_push( &full_samples, buffer );
+    }
+}
+
+// Pthread fallback of the writer
+static void *writer_thread( void *arg ) {
+    int last;
+    do {
+        struct sample_buffer *buffer = queue_pop( &full_samples );
+        if ( buffer->size && pwrite( pipe_fd, buffer->samples, buffer->size, buffer->offset ) != buffer->size ) write_error();
+        last = buffer->last; // The buffer can be reused after the push
+        queue_push( &free_samples, buffer );
+    } while ( !last );
+    return 0;
+}
+
+static void *render_thread( void *arg ) {
+    struct run_buffer *runs;
+    int last;
+    struct sample_buffer *samples = get_sample_buffer();
+    samples->size = 0;
+    samples->last = 0;
+    do {
+        runs = queue_pop( &full_runs );
+        for( int i = 0; i < runs->count; i++ ) {
+            unsigned int n = runs->runs[ i ].samples;
+            unsigned char in = runs->runs[ i ].level;
+            unsigned char bytes[ BYTE_MAX_SAMPLES ];
+            unsigned char *rendered = 0;
+            if ( !n ) { // Byte: rendered first, and copied to the sample buffers
+                n = render_byte( bytes, in, runs->runs[ i ].start, runs->runs[ i ].baud );
+                rendered = bytes;
+            }
+            while ( n ) {
+                unsigned int part = SAMPLE_BUFFER_SIZE - samples->size;
+                if ( part > n ) part = n;
+                unsigned char *out = samples->samples + samples->size;
+                if ( rendered ) {
+                    memcpy( out, rendered, part );
+                    rendered += part;
+                } else {
+                    render_samples( out, part, in );
+                }
+                samples->size += part;
+                n -= part;
+                if ( samples->size == SAMPLE_BUFFER_SIZE ) {
+                    put_sample_buffer( samples );
+                    samples = get_sample_buffer();
+                    samples->size = 0;
+                    samples->last = 0;
+                }
+            }
+        }
+        last = runs->last; // The buffer can be reused after the push
+        queue_push( &free_runs, runs );
+    } while ( !last );
+    samples->last = 1;
+    put_sample_buffer( samples );
+    while ( ring.fd >= 0 && ring.inFlight ) queue_push( &free_samples, uring_complete() );
+    return 0;
+}
+
+// Reader side: the runs go to the run buffer
+static void queue_run( unsigned char in, unsigned int samples ) {
+    if ( reader_buffer->count == RUN_BUFFER_SIZE ) {
+        queue_push( &full_runs, reader_buffer );
+        reader_buffer = queue_pop( &free_runs );
+        reader_buffer->count = 0;
+        reader_buffer->last = 0;
+    }
+    reader_buffer->runs[ reader_buffer->count ].samples = samples;
+    reader_buffer->runs[ reader_buffer->count ].start = level;
+    reader_buffer->runs[ reader_buffer->count ].baud = wav_baud;
+    reader_buffer->runs[ reader_buffer->count++ ].level = in;
+}
+
+static void print_queue_stats( struct queue *q ) {
+    fprintf( stdout, "  %-20s: max depth %d, avg depth %.1f, producer stall %.1f ms, consumer stall %.1f ms\n",
+        q->name, q->maxDepth, q->pushes ? (double)q->depthSum / q->pushes : 0.0, q->pushWaitMs, q->popWaitMs );
+}
+
+static void convert( FILE *tap, FILE* wav );
+static void write_silence( FILE *wavfile );
+
+// Converts the tap to the wav data with the reader, renderer and writer stages
+static void convert_pipeline( FILE *tap, FILE *wav ) {
+    pthread_t renderer, writer;
+    static struct run_buffer runBuffers[ RUN_BUFFERS ];
+    static struct sample_buffer sampleBuffers[ SAMPLE_BUFFERS ];
+    double start = now_ms();
+    fflush( wav );
+    pipe_fd = fileno( wav );
+    pipe_offset = ftello( wav );
+    queue_init( &free_runs );
+    queue_init( &full_runs );
+    queue_init( &free_samples );
+    queue_init( &full_samples );
+    for( int i = 1; i < RUN_BUFFERS; i++ ) queue_push( &free_runs, &runBuffers[ i ] );
+    for( int i = 0; i < SAMPLE_BUFFERS; i++ ) queue_push( &free_samples, &sampleBuffers[ i ] );
+    free_runs.pushes = free_runs.depthSum = free_runs.maxDepth = 0;
+    free_samples.pushes = free_samples.depthSum = free_samples.maxDepth = 0;
+    if ( !uringMode || !uring_init( SAMPLE_BUFFERS ) ) {
+        pthread_create( &writer, 0, writer_thread, 0 );
+    }
+    reader_buffer = &runBuffers[ 0 ];
+    reader_buffer->count = 0;
+    reader_buffer->last = 0;
+    pipelineMode = 2;
+    pthread_create( &renderer, 0, render_thread, 0 );
+    write_silence( wav ); /* Lead in silence */
+    level = 0;
+    convert( tap, wav );
+    reader_buffer->last = 1;
+    queue_push( &full_runs, reader_buffer );
+    pthread_join( renderer, 0 );
+    if ( ring.fd < 0 ) pthread_join( writer, 0 );
+    pipelineMode = 1;
+    fseeko( wav, pipe_offset, SEEK_SET );
+    if ( pipelineStats ) {
+        fprintf( stdout, "Pipeline (%s writer), %.1f ms:\n", ring.fd >= 0 ? "io_uring" : "thread", now_ms() - start );
+        print_queue_stats( &full_runs );
+        print_queue_stats( &free_runs );
+        print_queue_stats( &free_samples );
+        if ( ring.fd >= 0 ) {
+            fprintf( stdout, "  %-20s: renderer stall %.1f ms\n", "write completions", writeWaitMs );
+        } else {
+            print_queue_stats( &full_samples );
+        }
+    }
+}
+
+// Output samples with constant input level
+static void output_run( unsigned char in, unsigned int samples, FILE *fp ) {
+    if ( pipelineMode == 2 ) {
+        queue_run( in, samples );
+    } else if ( benchMode ) {
+        if ( !( bench_runs.count & 0xFFFF ) ) {
+            bench_runs.samples = realloc( bench_runs.samples, ( bench_runs.count + 0x10000 ) * sizeof( unsigned int ) );
+            bench_runs.levels = realloc( bench_runs.levels, bench_runs.count + 0x10000 );
+        }
+        bench_runs.samples[ bench_runs.count ] = samples;
+        bench_runs.levels[ bench_runs.count++ ] = in;
+        bench_runs.total += samples;
+    } else if ( cswMode ) {
+        csw_output( in, samples, fp );
+    } else if ( count_only ) {
+        render_pos += samples;
+    } else if ( render_start == 0 && render_end < 0 ) {
+        unsigned char out[ 256 ];
+        for ( unsigned int j=0; j<samples; j+=sizeof( out ) ) {
+            unsigned int n = samples - j < sizeof( out ) ? samples - j : sizeof( out );
+            render_samples( out, n, in );
+            fwrite( out, 1, n, fp );
+        }
+        render_pos += samples;
+    } else { // Skip the samples before the window, and drop the samples after it
+        long long end = render_pos + samples;
+        if ( render_pos < render_start ) {
+            unsigned int skip = ( end < render_start ? end : render_start ) - render_pos;
+            skip_filter( in, skip );
+            render_pos += skip;
+        }
+        while ( render_pos < end && ( render_end < 0 || render_pos < render_end ) ) {
+            filter_output( in, fp );
+            render_pos++;
+        }
+        render_pos = end;
+    }
 }
 
 static void dump_bit(FILE *fp, unsigned int bit) {
-    unsigned int j;
-    unsigned int period = (unsigned int)( bauds_to_samples( wav_baud ) / ( bit + 1 ) );
+    double cell = bauds_to_samples( wav_baud ) / ( bit + 1 );
+    unsigned int period = (unsigned int)cell;
 
     do {
-        for (j=0; j<period ; j++) {
-            filter_output(level ? p_silence : p_gain , fp);
+        if ( cswMode ) { // Rounded edges of the exact cells, so the baud is not changed by the truncation
+            csw_clock += cell;
+            period = llround( csw_clock ) - csw_edge;
+            csw_edge += period;
         }
+        output_run( level ? p_silence : p_gain, period, fp );
         level ^= 1;
     } while (bit--);
 }
 
-static void close_wav( FILE *outfile ) {
-    int full_size = ftell( outfile );
-    fseek( outfile, 4, SEEK_SET );
-    fwrite( &full_size, sizeof( full_size ), 1, outfile ); // Wave header 2. field : filesize with header. First the lowerest byte
-
-    int data_size = full_size - sizeof( wave );
-    fseek( outfile, sizeof( wave ) - 4 ,SEEK_SET ); // data chunk size position
-    fwrite( &data_size, sizeof( data_size ), 1, outfile );
+static void write_wav_header( FILE *wavfile ) {
+    if ( rf64Mode ) {
+        fwrite( &rf64, sizeof( rf64 ), 1, wavfile );
+        fwrite( wave.fmt, sizeof( wave ) - 12, 1, wavfile );
+    } else {
+        fwrite( &wave, sizeof( wave ), 1, wavfile );
+    }
+}
 
+static void close_wav( FILE *outfile ) {
+    long long full_size = ftello( outfile );
+    fprintf( stdout, "%lld kbytes written.\n", full_size / 1024 );
+    if ( rf64Mode ) {
+        rf64.riffSize = full_size - 8;
+        rf64.dataSize = full_size - RF64_HEADER_SIZE;
+        rf64.sampleCount = rf64.dataSize;
+        wave.data_size = 0xFFFFFFFF;
+    } else {
+        wave.rLen = full_size - 8; // Wave header 2. field : filesize without the first 8 bytes
+        wave.data_size = full_size - sizeof( wave );
+    }
+    fseeko( outfile, 0, SEEK_SET );
+    write_wav_header( outfile );
     fclose(outfile);
 }
 
 static unsigned char output_wav_byte( FILE *wavfile, unsigned char byte ) {
     unsigned int bc = 7;
+    if ( !benchMode && !cswMode && ( count_only || render_pos < render_start ) ) { // Whole bytes before the window
+        const struct skip_table *t = get_skip_table( wav_baud );
+        unsigned int n = t->samples[ level ][ byte ];
+        if ( count_only || render_pos + n <= render_start ) {
+            if ( !count_only ) skip_byte( t, byte, level );
+            render_pos += n;
+            level ^= __builtin_parity( byte );
+            return byte;
+        }
+    }
+    if ( cached_baud( wav_baud ) && !benchMode && !cswMode && !count_only && render_start == 0 && render_end < 0 ) {
+        if ( pipelineMode == 2 ) {
+            queue_run( byte, 0 );
+        } else {
+            unsigned char out[ BYTE_MAX_SAMPLES ];
+            unsigned int n = render_byte( out, byte, level, wav_baud );
+            fwrite( out, 1, n, wavfile );
+            render_pos += n;
+        }
+        level ^= __builtin_parity( byte ); // Every bit 1 has two runs, every bit 0 one run
+        return byte;
+    }
     do {
         dump_bit( wavfile, (byte >> bc)&1 );
     } while (bc--);
@@ -113,14 +911,41 @@ static unsigned char output_wav_byte( FILE *wavfile, unsigned char byte ) {
 }
 
 static void write_silence(FILE *wavfile) {
-    unsigned int j;
-    for( j=0; j<cycles_to_samples(15000); j++ ) {
-        filter_output( p_silence, wavfile );
+    output_run( p_silence, cycles_to_samples(15000), wavfile );
+}
+
+static void init_csw( FILE *cswfile ) {
+    wave.nSamplesPerSec = CSW_RATE;
+    csw.sampleRate = wave.nSamplesPerSec;
+    csw.compression = cswMode;
+    fwrite( &csw, sizeof( csw ), 1, cswfile );
+    if ( cswMode == 2 ) {
+        memset( &csw_zstream, 0, sizeof( csw_zstream ) );
+        if ( deflateInit( &csw_zstream, Z_BEST_COMPRESSION ) != Z_OK ) {
+            fprintf( stderr, "Z-RLE compressor init error.\n" );
+            exit(1);
+        }
+    }
+    /* Lead in silence */
+    write_silence( cswfile );
+    level = 0;
+}
+
+static void close_csw( FILE *outfile ) {
+    csw_flush_pulse( outfile );
+    if ( cswMode == 2 ) {
+        csw_write( outfile, 0, 0 );
+        deflateEnd( &csw_zstream );
     }
+    long long size = ftello( outfile );
+    fprintf( stdout, "%u pulses, %lld bytes written.\n", csw.pulseCount, size );
+    fseek( outfile, 0, SEEK_SET );
+    fwrite( &csw, sizeof( csw ), 1, outfile ); // Rewrite header with the pulse counter
+    fclose( outfile );
 }
 
 static void init_wav( FILE *wavfile ) {
-    fwrite( &wave, sizeof( wave ), 1, wavfile );
+    write_wav_header( wavfile );
     /* Lead in silence */
     write_silence( wavfile );
     level = 0;
@@ -151,15 +976,49 @@ static void insert_turbo_design_block( FILE* wav ) {
     output_wav_byte( wav, checksum );
 }
 
+/**
+ * Stores the first sample of the tap blocks. The block 0 is the lead in, the leader and the name.
+ * The next blocks are the SYSTEM data and entry blocks. The bytes between the blocks belong to the previous block.
+ */
+static void mark_block( long long pos, unsigned char byte ) {
+    static long long next_block_pos = 263;
+    static long long size_pos = -1;
+    if ( pos == 0 ) {
+        next_block_pos = 263;
+        size_pos = -1;
+        block_samples = realloc( block_samples, sizeof( long long ) );
+        block_samples[ 0 ] = 0;
+        block_count = 1;
+    }
+    if ( pos == 256 && byte != 0x55 ) next_block_pos = -1; // BASIC program is one block
+    if ( pos == next_block_pos ) {
+        if ( byte == 0x3C || byte == 0x78 ) {
+            block_samples = realloc( block_samples, ( block_count + 1 ) * sizeof( long long ) );
+            block_samples[ block_count++ ] = render_pos;
+            if ( byte == 0x3C ) size_pos = pos + 1;
+            next_block_pos += 3;
+        } else {
+            next_block_pos++;
+        }
+    } else if ( pos == size_pos ) {
+        next_block_pos = size_pos + 4 + ( byte ? byte : 256 );
+    }
+}
+
 static void convert( FILE *tap, FILE* wav ) {
     unsigned char byte;
-    int counter = 0;
-    fseek( tap, 0L, SEEK_END );
-    int tapSize = ftell( tap );
-    int posEntry = tapSize - 3; // Entry block
-    fseek( tap, 0, SEEK_SET );
-    while ( !feof( tap ) ) {
+    long long counter = 0;
+    long long pos = 0;
+    fseeko( tap, 0L, SEEK_END );
+    long long tapSize = ftello( tap );
+    long long posEntry = tapSize - 3; // Entry block
+    fseeko( tap, 0, SEEK_SET );
+    while ( !feof( tap ) && ( render_end < 0 || render_pos < render_end ) ) {
         byte = fgetc( tap );
+        if ( count_only ) {
+            mark_block( pos++, byte );
+            if ( last_block >= 0 && block_count > last_block + 1 ) return; // The end of the window found
+        }
         if ( turboMode ) {
             if ( counter == 256 ) { // 0x55 SYSTEM esetén
                 if ( byte != 0x55 ) { // Not SYSTEM tape
@@ -189,9 +1048,104 @@ static void convert( FILE *tap, FILE* wav ) {
         output_wav_byte( wav, byte );
     }
     write_silence( wav );
-    int size = ftell( wav ) / 1024;
-    fprintf( stdout, "%i kbytes written.\n", size );
-    fclose( tap );
+}
+
+/**
+ * Counts the samples of the tape, and the first samples of the blocks. With a block window the counting stops
+ * at the block after the last one, else the whole tape is counted, and stored in tape_samples.
+ * The counting pass only sums the byte lengths from the skip table, so it is fast.
+ */
+static long long count_samples( FILE *tap ) {
+    int savedTurboMode = turboMode;
+    unsigned int savedBaud = wav_baud;
+    long long savedEnd = render_end;
+    count_only = 1;
+    render_pos = 0;
+    render_end = -1;
+    level = 0;
+    write_silence( 0 );
+    convert( tap, 0 );
+    long long total = render_pos;
+    if ( last_block < 0 || block_count <= last_block + 1 ) tape_samples = total;
+    count_only = 0;
+    render_pos = 0;
+    render_end = savedEnd;
+    turboMode = savedTurboMode;
+    wav_baud = savedBaud;
+    return total;
+}
+
+// Converts the block range to sample window
+static void find_block_window( FILE *tap ) {
+    count_samples( tap );
+    if ( first_block >= block_count ) {
+        fprintf( stderr, "Block %d not found. The tap has %d blocks.\n", first_block, block_count );
+        exit(3);
+    }
+    render_start = block_samples[ first_block ];
+    render_end = ( last_block >= 0 && last_block + 1 < block_count ) ? block_samples[ last_block + 1 ] : -1;
+    fprintf( stdout, "Blocks %d-%d: samples %lld-%lld\n", first_block, last_block < 0 ? first_block : last_block, render_start, render_end < 0 ? tape_samples : render_end );
+}
+
+/**
+ * Selects the RF64 format, if the data is over the RIFF limit.
+ * The window length and the upper estimate from the tap size are used first, the samples counted only,
+ * if both are over the limit, and the tape is not counted yet.
+ */
+static void select_wav_format( FILE *tap ) {
+    fseeko( tap, 0L, SEEK_END );
+    long long tapBits = ( ftello( tap ) + 64 ) * 8; // With the turbo blocks
+    unsigned int minBaud = ( turboMode && defaultBaud < wav_baud ) ? defaultBaud : wav_baud;
+    long long end = tape_samples >= 0 ? tape_samples : tapBits * ( wave.nSamplesPerSec / minBaud + 1 ) + 2 * cycles_to_samples( 15000 );
+    if ( render_end >= 0 && render_end < end ) end = render_end;
+    if ( end - render_start + sizeof( wave ) - 8 > 0xFFFFFFFFLL && tape_samples < 0 && render_end < 0 ) {
+        end = count_samples( tap );
+    }
+    long long size = end > render_start ? end - render_start : 0;
+    rf64Mode = size + sizeof( wave ) - 8 > 0xFFFFFFFFLL;
+    if ( rf64Mode ) fprintf( stdout, "%lld samples, RF64 output\n", size );
+}
+
+static double render_bench_runs( unsigned char *out ) {
+    double best = 1e9;
+    for( int pass = 0; pass < 5; pass++ ) {
+        struct timespec start, end;
+        unsigned char *p = out;
+        lp_accu = hp_accu = 0;
+        clock_gettime( CLOCK_MONOTONIC, &start );
+        for( long i = 0; i < bench_runs.count; i++ ) {
+            render_samples( p, bench_runs.samples[ i ], bench_runs.levels[ i ] );
+            p += bench_runs.samples[ i ];
+        }
+        clock_gettime( CLOCK_MONOTONIC, &end );
+        double ns = ( end.tv_sec - start.tv_sec ) * 1e9 + ( end.tv_nsec - start.tv_nsec );
+        if ( ns < best ) best = ns;
+    }
+    return best / bench_runs.total;
+}
+
+// Renders the tap into memory with the generic filter and with the specialized kernels
+static void benchmark( FILE *tap ) {
+    benchMode = 1;
+    write_silence( 0 );
+    level = 0;
+    convert( tap, 0 );
+    benchMode = 0;
+    unsigned char *generic = malloc( bench_runs.total );
+    unsigned char *special = malloc( bench_runs.total );
+    memset( run_kernels, 0, sizeof( run_kernels ) );
+    double genericNs = render_bench_runs( generic );
+    init_kernels();
+    double kernelNs = render_bench_runs( special );
+    fprintf( stdout, "%ld runs, %ld samples at %d Hz\n", bench_runs.count, bench_runs.total, wave.nSamplesPerSec );
+    fprintf( stdout, "generic filter: %.2f ns/sample\n", genericNs );
+    long diffs = 0, maxDiff = 0;
+    for( long i = 0; i < bench_runs.total; i++ ) {
+        int diff = abs( generic[ i ] - special[ i ] );
+        if ( diff ) diffs++;
+        if ( diff > maxDiff ) maxDiff = diff;
+    }
+    fprintf( stdout, "kernels       : %.2f ns/sample (%.2fx), %ld samples differ, max difference %ld\n", kernelNs, genericNs / kernelNs, diffs, maxDiff );
 }
 
 static void print_usage() {
@@ -204,6 +1158,18 @@ static void print_usage() {
     printf( "-g <gain> : gain, must be between 1 and 7 (default: 6)\n");
     printf( "-b <baud> : baud (dafault 1150 )\n");
     printf( "-t        : turbo mode, system only (%d baud with loader)\n", turboBaud );
+    printf( "-f <rate> : sample rate (default: 44100)\n");
+    printf( "-c        : CSW v2 output with RLE compression instead of wav (%d Hz, the -f is ignored)\n", CSW_RATE );
+    printf( "-z        : CSW v2 output with Z-RLE compression instead of wav\n");
+    printf( "-s <sample>  : first rendered sample (default: 0)\n");
+    printf( "-l <samples> : number of rendered samples (default: to the end)\n");
+    printf( "-k <first>[-<last>] : render only the tap blocks (0: leader and name, 1-: data and entry blocks)\n");
+    printf( "-P        : synchronous wav output, without the reader, renderer and writer threads\n");
+    printf( "-u        : writer thread instead of io_uring\n");
+    printf( "-p        : prints the pipeline and byte cache statistics\n");
+    printf( "-K        : generic filter only, without the specialized render kernels\n");
+    printf( "-a        : byte cache for the whole wav, max 1 sample error (default: exact, every byte rendered by the filter)\n");
+    printf( "-x        : benchmark of the generic filter and the specialized kernels, without output\n");
     printf( "-h        : prints this text\n");
     exit(1);
 }
@@ -214,7 +1180,7 @@ int main(int argc, char *argv[]) {
     FILE *tapFile = 0, *wav = 0;
 
     while (!finished) {
-        switch (getopt (argc, argv, "?htf:i:o:g:b:")) {
+        switch (getopt (argc, argv, "?htczPupKaxf:i:o:g:b:s:l:k:")) {
             case -1:
             case ':':
                 finished = 1;
@@ -226,6 +1192,30 @@ int main(int argc, char *argv[]) {
             case 't':
                 turboMode = 1;
                 break;
+            case 'c':
+                if ( !cswMode ) cswMode = 1;
+                break;
+            case 'z':
+                cswMode = 2;
+                break;
+            case 'P':
+                pipelineMode = 0;
+                break;
+            case 'u':
+                uringMode = 0;
+                break;
+            case 'p':
+                pipelineStats = 1;
+                break;
+            case 'K':
+                kernelMode = 0;
+                break;
+            case 'a':
+                cacheMode = 1;
+                break;
+            case 'x':
+                benchMode = 1;
+                break;
             case 'f':
                 if ( !sscanf( optarg, "%i", &arg1 ) ) {
                     fprintf( stderr, "Error parsing argument for '-f'.\n");
@@ -238,7 +1228,7 @@ int main(int argc, char *argv[]) {
                             exit(3);
                     }
                     wave.nSamplesPerSec = arg1;
-                    wave.nAvgBytesPerSec = wave.nSamplesPerSec*wave.nChannels*(wave.nBitsPerSample%8);
+                    wave.nAvgBytesPerSec = wave.nSamplesPerSec*wave.nChannels*(wave.nBitsPerSample/8);
                 }
                 break;
             case 'g':
@@ -265,6 +1255,19 @@ int main(int argc, char *argv[]) {
                     wav_baud = arg1;
                 }
                 break;
+            case 's':
+                render_start = atoll( optarg );
+                break;
+            case 'l':
+                render_end = atoll( optarg );
+                break;
+            case 'k':
+                if ( sscanf( optarg, "%i-%i", &first_block, &last_block ) < 1 || first_block < 0 ) {
+                    fprintf( stderr, "Error parsing argument for '-k'.\n");
+                    exit(2);
+                }
+                if ( last_block < 0 ) last_block = first_block;
+                break;
             case 'i':
                 if ( !(tapFile = fopen( optarg, "rb")) ) {
                     fprintf( stderr, "Error opening %s.\n", optarg);
@@ -282,14 +1285,41 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if ( !tapFile ) {
+    if ( render_end >= 0 ) render_end += render_start; // Length to end position
+    init_kernels();
+    if ( cacheMode ) init_byte_cache();
+    if ( tapFile && benchMode ) {
+        benchmark( tapFile );
+    } else if ( !tapFile ) {
         print_usage();
     } else if ( !wav ) {
         print_usage();
-    } else {
-        init_wav( wav );
+    } else if ( cswMode && ( render_start || render_end >= 0 || first_block >= 0 ) ) {
+        fprintf( stderr, "The CSW output is always the whole tape.\n" );
+        exit(3);
+    } else if ( cacheMode && ( render_start || render_end >= 0 || first_block >= 0 ) ) {
+        fprintf( stderr, "The byte cache renders only the whole wav, the window is always exact.\n" );
+        exit(3);
+    } else if ( cswMode ) {
+        init_csw( wav );
         convert( tapFile, wav );
+        fclose( tapFile );
+        close_csw( wav );
+    } else {
+        if ( first_block >= 0 ) find_block_window( tapFile );
+        select_wav_format( tapFile );
+        struct stat st;
+        // The pipeline writes at file offsets, so a pipe or a terminal gets the synchronous output
+        if ( pipelineMode && render_start == 0 && render_end < 0 && !fstat( fileno( wav ), &st ) && S_ISREG( st.st_mode ) ) {
+            write_wav_header( wav );
+            convert_pipeline( tapFile, wav );
+        } else {
+            init_wav( wav );
+            convert( tapFile, wav );
+        }
+        fclose( tapFile );
         close_wav( wav );
+        if ( pipelineStats ) print_cache_stats();
     }
 
     return 0;
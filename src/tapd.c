@@ -0,0 +1,462 @@
+/**
+ * Resident conversion service for cas2tap, cmd2tap and tap2wav over a local Unix domain socket.
+ * The converters are linked into this program, so a request costs a fork instead of a process start.
+ * The forked child is the per request context: it starts from the clean global state of the converters,
+ * and an exit() of a converter ends only its request.
+ *
+ * Request: one message with the converter name and its arguments (0 separated).
+ * Optional SCM_RIGHTS ancillary data: input and output file descriptors. These are given to the converter as
+ * -i and -o arguments, so the files are opened by the client.
+ * Response: the converter messages, and a last line: "tapd: exit <code> <microseconds> us".
+ * The "stats" request returns the concurrency and latency counters.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include "getopt.h"
+
+#define VM 0
+#define VS 4
+#define VB 'b'
+
+#define MAX_REQUEST 4096
+#define MAX_ARGS 64
+#define MAX_JOBS 256
+
+int cas2tap_main( int argc, char *argv[] );
+int cmd2tap_main( int argc, char *argv[] );
+int tap2wav_main( int argc, char *argv[] );
+
+struct tool {
+    const char *name;
+    int ( *main )( int argc, char *argv[] );
+    long requests;
+    long failures;
+    double totalUs;
+    double maxUs;
+} tools[] = {
+    { "cas2tap", cas2tap_main, 0, 0, 0, 0 },
+    { "cmd2tap", cmd2tap_main, 0, 0, 0, 0 },
+    { "tap2wav", tap2wav_main, 0, 0, 0, 0 },
+};
+
+#define TOOL_COUNT ( sizeof( tools ) / sizeof( tools[ 0 ] ) )
+
+struct job {
+    pid_t pid;
+    int conn;
+    struct tool *tool;
+    struct timespec start;
+} jobs[ MAX_JOBS ];
+
+static int listener = -1;
+static int sigfd = -1;
+static int maxJobs = 0;     // Concurrency limit, default the number of cpus
+static int runningJobs = 0;
+static long rejectedRequests = 0;
+
+static double elapsed_us( struct timespec *start ) {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ( now.tv_sec - start->tv_sec ) * 1e6 + ( now.tv_nsec - start->tv_nsec ) / 1e3;
+}
+
+/**
+ * Requests being received. The accepted connections are non-blocking, and read by the main loop as the data
+ * arrives, so a slow or idle client does not stall the other requests. The request is a 4 byte length and the
+ * arguments, the file descriptors come with the first bytes. An incomplete request is dropped after the timeout.
+ */
+#define REQUEST_TIMEOUT_MS 5000
+
+struct pending {
+    int conn;                 // -1 - free slot
+    int fds[ 2 ];
+    unsigned int got;         // Received bytes with the length
+    int ready;                // 1 - complete, waits for a free job
+    struct timespec start;
+    union {
+        unsigned int size;
+        char bytes[ sizeof( unsigned int ) + MAX_REQUEST ];
+    } data;
+} pendings[ MAX_JOBS ];
+static int pendingCount = 0;
+
+static void drop_pending( struct pending *p ) {
+    for( int i = 0; i < 2; i++ ) if ( p->fds[ i ] >= 0 ) close( p->fds[ i ] );
+    close( p->conn );
+    p->conn = -1;
+    pendingCount--;
+}
+
+static void add_pending( int conn ) {
+    struct pending *p = pendings;
+    while ( p->conn >= 0 ) p++;
+    p->conn = conn;
+    p->fds[ 0 ] = p->fds[ 1 ] = -1;
+    p->got = 0;
+    p->ready = 0;
+    clock_gettime( CLOCK_MONOTONIC, &p->start );
+    pendingCount++;
+}
+
+// Receives the available bytes of the request. Returns 1, if the request is complete, 0 if more bytes needed, -1 on error.
+static int receive_request( struct pending *p ) {
+    char control[ CMSG_SPACE( 2 * sizeof( int ) ) ];
+    struct iovec iov = { p->data.bytes + p->got, sizeof( p->data.bytes ) - p->got };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof( control );
+    ssize_t len = recvmsg( p->conn, &msg, MSG_DONTWAIT );
+    if ( len < 0 && ( errno == EAGAIN || errno == EINTR ) ) return 0;
+    if ( len <= 0 ) return -1;
+    for( struct cmsghdr *c = CMSG_FIRSTHDR( &msg ); c; c = CMSG_NXTHDR( &msg, c ) ) {
+        if ( c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && p->fds[ 0 ] < 0 ) {
+            int count = ( c->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+            memcpy( p->fds, CMSG_DATA( c ), ( count > 2 ? 2 : count ) * sizeof( int ) );
+        }
+    }
+    p->got += len;
+    if ( p->got < sizeof( p->data.size ) ) return 0;
+    if ( p->data.size >= MAX_REQUEST || !p->data.size ) return -1;
+    return p->got >= sizeof( p->data.size ) + p->data.size;
+}
+
+// The arguments of the complete request. Returns the argument count.
+static int parse_request( struct pending *p, char *args[] ) {
+    unsigned int size = p->data.size;
+    char *buffer = p->data.bytes + sizeof( size );
+    buffer[ size ] = 0;
+    int argc = 0;
+    for( char *a = buffer; a < buffer + size && argc < MAX_ARGS; a += strlen( a ) + 1 ) args[ argc++ ] = a;
+    args[ argc ] = 0;
+    return argc;
+}
+
+static void send_stats( int conn ) {
+    char text[ 1024 ];
+    int len = snprintf( text, sizeof( text ), "running %d/%d, rejected %ld\n", runningJobs, maxJobs, rejectedRequests );
+    for( int i = 0; i < TOOL_COUNT; i++ ) {
+        struct tool *t = &tools[ i ];
+        len += snprintf( text + len, sizeof( text ) - len, "%s: %ld requests, %ld failed, avg %.0f us, max %.0f us\n",
+            t->name, t->requests, t->failures, t->requests ? t->totalUs / t->requests : 0.0, t->maxUs );
+    }
+    len += snprintf( text + len, sizeof( text ) - len, "tapd: exit 0 0 us\n" );
+    write( conn, text, len );
+}
+
+// Runs the converter in the forked child. The converter messages go to the client.
+static void run_job( struct tool *tool, int conn, int argc, char *args[], int fds[ 2 ] ) {
+    char inName[ 32 ], outName[ 32 ];
+    char *argv[ MAX_ARGS + 6 ];
+    sigset_t mask;
+    sigemptyset( &mask );
+    sigprocmask( SIG_SETMASK, &mask, 0 );
+    // The client sees the end of the response, when every copy of its connection closed
+    close( listener );
+    close( sigfd );
+    for( int i = 0; i < maxJobs; i++ ) if ( jobs[ i ].pid ) close( jobs[ i ].conn );
+    for( int i = 0; i < MAX_JOBS; i++ ) if ( pendings[ i ].conn >= 0 && pendings[ i ].conn != conn ) close( pendings[ i ].conn );
+    dup2( conn, 1 );
+    dup2( conn, 2 );
+    int n = 0;
+    for( int i = 0; i < argc; i++ ) argv[ n++ ] = args[ i ];
+    if ( fds[ 0 ] >= 0 ) {
+        sprintf( inName, "/proc/self/fd/%d", fds[ 0 ] );
+        argv[ n++ ] = "-i";
+        argv[ n++ ] = inName;
+    }
+    if ( fds[ 1 ] >= 0 ) {
+        sprintf( outName, "/proc/self/fd/%d", fds[ 1 ] );
+        argv[ n++ ] = "-o";
+        argv[ n++ ] = outName;
+    }
+    argv[ n ] = 0;
+    optind = 0; // Full getopt reinit for the converter
+    exit( tool->main( n, argv ) );
+}
+
+static void start_job( int conn, int argc, char *args[], int fds[ 2 ] ) {
+    fcntl( conn, F_SETFL, fcntl( conn, F_GETFL ) & ~O_NONBLOCK ); // The response is written by blocking writes
+    struct tool *tool = 0;
+    for( int i = 0; argc && i < TOOL_COUNT; i++ ) if ( !strcmp( args[ 0 ], tools[ i ].name ) ) tool = &tools[ i ];
+    if ( argc && !strcmp( args[ 0 ], "stats" ) ) {
+        send_stats( conn );
+    } else if ( !tool ) {
+        dprintf( conn, "Unknown converter: %s\ntapd: exit 2 0 us\n", argc ? args[ 0 ] : "" );
+    } else if ( runningJobs >= maxJobs ) { // The listener is not polled while full, so this is only a safety net
+        rejectedRequests++;
+        dprintf( conn, "Too many requests\ntapd: exit 5 0 us\n" );
+    } else {
+        int slot = 0;
+        while ( jobs[ slot ].pid ) slot++;
+        jobs[ slot ].conn = conn;
+        jobs[ slot ].tool = tool;
+        clock_gettime( CLOCK_MONOTONIC, &jobs[ slot ].start );
+        pid_t pid = fork();
+        if ( pid == 0 ) {
+            run_job( tool, conn, argc, args, fds );
+        } else if ( pid > 0 ) {
+            jobs[ slot ].pid = pid;
+            runningJobs++;
+            for( int i = 0; i < 2; i++ ) if ( fds[ i ] >= 0 ) close( fds[ i ] );
+            return; // The connection is closed, when the job finished
+        } else {
+            dprintf( conn, "Fork error\ntapd: exit 5 0 us\n" );
+        }
+    }
+    for( int i = 0; i < 2; i++ ) if ( fds[ i ] >= 0 ) close( fds[ i ] );
+    close( conn );
+}
+
+static void finish_jobs() {
+    int status;
+    pid_t pid;
+    while ( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 ) {
+        for( int i = 0; i < maxJobs; i++ ) {
+            if ( jobs[ i ].pid == pid ) {
+                struct job *job = &jobs[ i ];
+                double us = elapsed_us( &job->start );
+                int code = WIFEXITED( status ) ? WEXITSTATUS( status ) : 128 + WTERMSIG( status );
+                job->tool->requests++;
+                if ( code ) job->tool->failures++;
+                job->tool->totalUs += us;
+                if ( us > job->tool->maxUs ) job->tool->maxUs = us;
+                dprintf( job->conn, "tapd: exit %d %.0f us\n", code, us );
+                close( job->conn );
+                job->pid = 0;
+                runningJobs--;
+            }
+        }
+    }
+}
+
+static void serve( const char *socketName ) {
+    struct sockaddr_un addr = { AF_UNIX };
+    strncpy( addr.sun_path, socketName, sizeof( addr.sun_path ) - 1 );
+    listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+    unlink( socketName );
+    if ( listener < 0 || bind( listener, (struct sockaddr*)&addr, sizeof( addr ) ) || listen( listener, 64 ) ) {
+        fprintf( stderr, "Error creating socket %s.\n", socketName );
+        exit(4);
+    }
+    signal( SIGPIPE, SIG_IGN ); // A client can disconnect before the response
+    sigset_t mask;
+    sigemptyset( &mask );
+    sigaddset( &mask, SIGCHLD );
+    sigprocmask( SIG_BLOCK, &mask, 0 );
+    sigfd = signalfd( -1, &mask, SFD_CLOEXEC );
+    fprintf( stdout, "tapd listening on %s, max %d parallel jobs\n", socketName, maxJobs );
+    fflush( stdout );
+    for( int i = 0; i < MAX_JOBS; i++ ) pendings[ i ].conn = -1;
+    for( ;; ) {
+        struct pollfd pfd[ 2 + MAX_JOBS ] = { { sigfd, POLLIN }, { listener, POLLIN } };
+        struct pending *polled[ MAX_JOBS ];
+        int n = 2, timeout = -1;
+        for( int i = 0; i < MAX_JOBS; i++ ) {
+            if ( pendings[ i ].conn < 0 || pendings[ i ].ready ) continue;
+            int left = REQUEST_TIMEOUT_MS - (int)( elapsed_us( &pendings[ i ].start ) / 1000 );
+            if ( left < 0 ) left = 0;
+            if ( timeout < 0 || left < timeout ) timeout = left;
+            polled[ n - 2 ] = &pendings[ i ];
+            pfd[ n++ ] = (struct pollfd){ pendings[ i ].conn, POLLIN };
+        }
+        // Over the limit the new connections wait in the listen queue
+        if ( pendingCount >= MAX_JOBS ) pfd[ 1 ].fd = -1;
+        if ( poll( pfd, n, timeout ) < 0 ) continue;
+        if ( pfd[ 0 ].revents & POLLIN ) {
+            struct signalfd_siginfo info;
+            read( sigfd, &info, sizeof( info ) );
+            finish_jobs();
+        }
+        for( int i = 2; i < n; i++ ) {
+            struct pending *p = polled[ i - 2 ];
+            int state = pfd[ i ].revents ? receive_request( p ) : 0;
+            if ( state > 0 ) {
+                p->ready = 1;
+            } else if ( state < 0 || elapsed_us( &p->start ) >= REQUEST_TIMEOUT_MS * 1000.0 ) {
+                drop_pending( p );
+            }
+        }
+        // The complete requests in arrival order, the converters only while a job is free
+        for( ;; ) {
+            struct pending *next = 0;
+            for( int i = 0; i < MAX_JOBS; i++ ) {
+                struct pending *p = &pendings[ i ];
+                if ( p->conn < 0 || !p->ready ) continue;
+                char *args[ MAX_ARGS + 1 ];
+                parse_request( p, args );
+                if ( runningJobs >= maxJobs && strcmp( args[ 0 ], "stats" ) ) continue; // The stats is answered at once
+                if ( !next || elapsed_us( &p->start ) > elapsed_us( &next->start ) ) next = p;
+            }
+            if ( !next ) break;
+            char *args[ MAX_ARGS + 1 ];
+            int argc = parse_request( next, args );
+            start_job( next->conn, argc, args, next->fds );
+            next->conn = -1; // The connection and the files belong to the job
+            pendingCount--;
+        }
+        if ( pfd[ 1 ].revents & POLLIN ) {
+            int conn = accept4( listener, 0, 0, SOCK_CLOEXEC | SOCK_NONBLOCK );
+            if ( conn >= 0 ) add_pending( conn );
+        }
+    }
+}
+
+/**
+ * Client: sends the request with the input and output files, and prints the response.
+ * Returns the exit code of the converter.
+ */
+static int request( const char *socketName, const char *inName, const char *outName, int argc, char *argv[] ) {
+    struct sockaddr_un addr = { AF_UNIX };
+    strncpy( addr.sun_path, socketName, sizeof( addr.sun_path ) - 1 );
+    int conn = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( conn < 0 || connect( conn, (struct sockaddr*)&addr, sizeof( addr ) ) ) {
+        fprintf( stderr, "Error connecting to %s.\n", socketName );
+        exit(4);
+    }
+    char buffer[ MAX_REQUEST ];
+    char name[ 7 ] = "";
+    int size = 0;
+    int hasName = 0;
+    for( int i = 1; i < argc; i++ ) if ( !strncmp( argv[ i ], "-n", 2 ) ) hasName = 1;
+    for( int i = 0; i < argc; i++ ) {
+        int len = strlen( argv[ i ] ) + 1;
+        if ( size + len + 16 >= MAX_REQUEST ) {
+            fprintf( stderr, "Too long request.\n" );
+            exit(2);
+        }
+        memcpy( buffer + size, argv[ i ], len );
+        size += len;
+    }
+    if ( !strcmp( argv[ 0 ], "cmd2tap" ) && inName && !hasName ) { // The server sees only the file descriptor, not the name
+        const char *base = strrchr( inName, '/' ) ? strrchr( inName, '/' ) + 1 : inName;
+        for( int i = 0; i < 6 && base[ i ] && base[ i ] != '.'; i++ ) name[ i ] = base[ i ];
+        memcpy( buffer + size, "-n", 3 );
+        memcpy( buffer + size + 3, name, strlen( name ) + 1 );
+        size += 3 + strlen( name ) + 1;
+    }
+    int fds[ 2 ], fdCount = 0;
+    if ( inName && ( fds[ fdCount++ ] = open( inName, O_RDONLY ) ) < 0 ) {
+        fprintf( stderr, "Error opening %s.\n", inName );
+        exit(4);
+    }
+    if ( outName && ( fds[ fdCount++ ] = open( outName, O_RDWR | O_CREAT | O_TRUNC, 0644 ) ) < 0 ) {
+        fprintf( stderr, "Error creating %s.\n", outName );
+        exit(4);
+    }
+    char control[ CMSG_SPACE( 2 * sizeof( int ) ) ];
+    unsigned int length = size;
+    struct iovec iov[ 2 ] = { { &length, sizeof( length ) }, { buffer, size } };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if ( fdCount ) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE( fdCount * sizeof( int ) );
+        struct cmsghdr *c = CMSG_FIRSTHDR( &msg );
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN( fdCount * sizeof( int ) );
+        memcpy( CMSG_DATA( c ), fds, fdCount * sizeof( int ) );
+    }
+    if ( sendmsg( conn, &msg, 0 ) != sizeof( length ) + size ) {
+        fprintf( stderr, "Error sending request.\n" );
+        exit(4);
+    }
+    // The last line is the exit status
+    char response[ 4096 ];
+    char line[ 256 ] = "", last[ 256 ] = "";
+    int lineLen = 0;
+    ssize_t len;
+    while ( ( len = read( conn, response, sizeof( response ) ) ) > 0 ) {
+        fwrite( response, 1, len, stdout );
+        for( int i = 0; i < len; i++ ) {
+            if ( response[ i ] == '\n' ) {
+                line[ lineLen ] = 0;
+                strcpy( last, line );
+                lineLen = 0;
+            } else if ( lineLen < sizeof( line ) - 1 ) {
+                line[ lineLen++ ] = response[ i ];
+            }
+        }
+    }
+    close( conn );
+    int code = 5;
+    sscanf( last, "tapd: exit %d", &code );
+    return code;
+}
+
+static void print_usage() {
+    printf( "tapd v%d.%d%c (build: %s)\n", VM, VS, VB, __DATE__ );
+    printf( "Resident cas2tap, cmd2tap and tap2wav conversion service.\n");
+    printf( "Copyright 2022 by László Princz\n");
+    printf( "Usage:\n");
+    printf( "tapd -l <socket> [-j <jobs>]\n");
+    printf( "tapd -c <socket> [-i <input>] [-o <output>] <converter> [converter options]\n");
+    printf( "tapd -c <socket> stats\n");
+    printf( "Command line option:\n");
+    printf( "-l <socket> : server mode, listen on the socket\n");
+    printf( "-j <jobs>   : max parallel conversions (default: number of cpus)\n");
+    printf( "-c <socket> : client mode, send a request\n");
+    printf( "-i <input>  : input file, opened by the client\n");
+    printf( "-o <output> : output file, created by the client\n");
+    printf( "-h          : prints this text\n");
+    exit(1);
+}
+
+int main( int argc, char *argv[] ) {
+    int opt = 0;
+    char *listenName = 0, *connectName = 0;
+    char *inName = 0, *outName = 0;
+
+    // The converter options start at the converter name
+    while ( ( opt = getopt( argc, argv, "+?hl:j:c:i:o:" ) ) != -1 ) {
+        switch ( opt ) {
+            case '?':
+            case 'h':
+                print_usage();
+                break;
+            case 'l':
+                listenName = optarg;
+                break;
+            case 'j':
+                maxJobs = atoi( optarg );
+                break;
+            case 'c':
+                connectName = optarg;
+                break;
+            case 'i':
+                inName = optarg;
+                break;
+            case 'o':
+                outName = optarg;
+                break;
+            default:
+                break;
+        }
+    }
+    if ( maxJobs <= 0 ) maxJobs = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( maxJobs > MAX_JOBS ) maxJobs = MAX_JOBS;
+
+    if ( listenName ) {
+        serve( listenName );
+    } else if ( connectName && optind < argc ) {
+        return request( connectName, inName, outName, argc - optind, argv + optind );
+    } else {
+        print_usage();
+    }
+    return 0;
+}
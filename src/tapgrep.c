@@ -0,0 +1,582 @@
+/**
+ * Full text index of the BASIC tapes. The programs are detokenized (line links, line numbers, Level II and Colour
+ * Genie keyword tokens), and the words of the lines (keywords, variables, numbers, and the words of the strings) go
+ * to an inverted index. The index file is a list of segments. A segment is a document table, a sorted term table
+ * (term hash, postings) and the postings (document numbers). The update appends a new segment with the new and
+ * changed tapes, and the last document of a path is valid. The query is tokenized like a program line, so it is
+ * split by the keywords like the index. The query maps the file, intersects the postings of the query words in every
+ * segment, and the candidate programs are detokenized again, and their lines containing the query are printed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "getopt.h"
+
+#define VM 0
+#define VS 4
+#define VB 'b'
+
+#define MAX_PATH 256
+#define MAX_TAP 0x100000
+#define MAX_THREADS 64
+#define MAX_QUERY_TERMS 32
+
+/* Level II BASIC keyword tokens from 0x80 */
+static const char *tokens[] = {
+    "END", "FOR", "RESET", "SET", "CLS", "CMD", "RANDOM", "NEXT",
+    "DATA", "INPUT", "DIM", "READ", "LET", "GOTO", "RUN", "IF",
+    "RESTORE", "GOSUB", "RETURN", "REM", "STOP", "ELSE", "TRON", "TROFF",
+    "DEFSTR", "DEFINT", "DEFSNG", "DEFDBL", "LINE", "EDIT", "ERROR", "RESUME",
+    "OUT", "ON", "OPEN", "FIELD", "GET", "PUT", "CLOSE", "LOAD",
+    "MERGE", "NAME", "KILL", "LSET", "RSET", "SAVE", "SYSTEM", "LPRINT",
+    "DEF", "POKE", "PRINT", "CONT", "LIST", "LLIST", "DELETE", "AUTO",
+    "CLEAR", "CLOAD", "CSAVE", "NEW", "TAB(", "TO", "FN", "USING",
+    "VARPTR", "USR", "ERL", "ERR", "STRING$", "INSTR", "POINT", "TIME$",
+    "MEM", "INKEY$", "THEN", "NOT", "STEP", "+", "-", "*",
+    "/", "^", "AND", "OR", ">", "=", "<", "SGN",
+    "INT", "ABS", "FRE", "INP", "POS", "SQR", "RND", "LOG",
+    "EXP", "COS", "SIN", "TAN", "ATN", "PEEK", "CVI", "CVS",
+    "CVD", "EOF", "LOC", "LOF", "MKI$", "MKS$", "MKD$", "CINT",
+    "CSNG", "CDBL", "FIX", "LEN", "STR$", "VAL", "ASC", "CHR$",
+    "LEFT$", "RIGHT$", "MID$", "'",
+};
+
+#define TOKEN_COUNT ( sizeof( tokens ) / sizeof( tokens[ 0 ] ) )
+
+/* Colour Genie BASIC keyword tokens: 0xFF prefix and the token from 0x80 */
+#define CG_PREFIX 0xFF
+static const char *cgTokens[] = {
+    "COLOUR", "FCOLOUR", "KEYPAD", "JOY", "PLOT", "FGR", "LGR", "FCLS",
+    "PLAY", "CIRCLE", "SCALE", "SHAPE", "NSHAPE", "XSHAPE", "PAINT", "CPOINT",
+    "NPLOT", "SOUND", "CHAR", "RENUM", "SWAP", "FKEY", "CALL", "VERIFY",
+    "BGRD", "NBGRD",
+};
+
+#define CG_TOKEN_COUNT ( sizeof( cgTokens ) / sizeof( cgTokens[ 0 ] ) )
+
+#pragma pack(1)
+struct segment_header {
+    char               magic[ 4 ];  // "TGRP"
+    unsigned int       docCount;
+    unsigned int       termCount;
+    unsigned int       postingCount;
+    unsigned long long size;        // Size of the segment with this header
+};
+
+struct doc_entry {
+    char               path[ MAX_PATH ];
+    long long          mtime;
+    long long          size;
+};
+
+struct term_entry {
+    unsigned long long hash;
+    unsigned int       first;       // Index of the first posting
+    unsigned int       count;
+};
+#pragma pack()
+
+struct posting {
+    unsigned long long hash;
+    unsigned int       doc;
+};
+
+struct index_job {
+    char             **paths;
+    int              count;
+    int              step, first;   // The thread works on the paths first, first + step, ...
+    struct posting   *postings;
+    size_t           postingCount;
+    int              *basic;        // 1 - the path is a BASIC tape
+    pthread_t        thread;
+};
+
+static unsigned long long term_hash( const char *term, int len ) {
+    unsigned long long h = 0xCBF29CE484222325ULL; // FNV-1a
+    for( int i = 0; i < len; i++ ) {
+        h ^= (unsigned char)toupper( term[ i ] );
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+/**
+ * Reads the BASIC body of the tap. Returns the position of the first line, or 0 if it is not a BASIC tap.
+ * The leader is skipped: 0xAA or 0x00 bytes with 0x66 or 0xA5 sync byte, or the emulator header.
+ */
+static size_t basic_body( const unsigned char *data, size_t size ) {
+    size_t pos = 0;
+    if ( size > 32 && !memcmp( data, "Colour Genie - Virtual Tape File", 32 ) ) {
+        for( pos = 32; pos < size && data[ pos ]; pos++ );
+        pos++;
+    } else {
+        while ( pos < size && ( data[ pos ] == 0xAA || data[ pos ] == 0x00 ) ) pos++;
+    }
+    if ( pos < size && ( data[ pos ] == 0x66 || data[ pos ] == 0xA5 ) ) pos++;
+    if ( pos >= size || data[ pos ] == 0x55 || data[ pos ] == 0x3C || data[ pos ] == 0x78 ) return 0;
+    pos += ( pos + 3 < size && data[ pos ] == 0xD3 && data[ pos + 1 ] == 0xD3 && data[ pos + 2 ] == 0xD3 ) ? 4 : 1;
+    return pos < size ? pos : 0;
+}
+
+/**
+ * Detokenizes the line from pos to text, like LIST. Returns the position of the next line, or 0 at the end.
+ * If spaced, the keywords are separate words for the index (GOTO10 is GOTO 10).
+ */
+static size_t detokenize_line( const unsigned char *data, size_t size, size_t pos, char *text, size_t textSize, int spaced ) {
+    if ( pos + 4 >= size || ( !data[ pos ] && !data[ pos + 1 ] ) ) return 0;
+    int len = snprintf( text, textSize, "%u ", data[ pos + 2 ] | data[ pos + 3 ] << 8 );
+    int quoted = 0;
+    for( pos += 4; pos < size && data[ pos ]; pos++ ) {
+        unsigned char byte = data[ pos ];
+        if ( byte == '"' ) quoted = !quoted;
+        if ( byte == CG_PREFIX && !quoted && pos + 1 < size && data[ pos + 1 ] >= 0x80 && data[ pos + 1 ] - 0x80 < CG_TOKEN_COUNT ) {
+            len += snprintf( text + len, textSize - len, spaced ? " %s " : "%s", cgTokens[ data[ ++pos ] - 0x80 ] );
+        } else if ( byte >= 0x80 && !quoted && byte - 0x80 < TOKEN_COUNT ) {
+            len += snprintf( text + len, textSize - len, spaced ? " %s " : "%s", tokens[ byte - 0x80 ] );
+        } else if ( byte >= 0x80 && !quoted ) { // Unknown token
+            len += snprintf( text + len, textSize - len, "{%02X}", byte );
+        } else if ( len + 1 < textSize ) {
+            text[ len++ ] = byte >= 0x20 && byte < 0x80 ? byte : '.';
+        }
+        if ( len >= textSize ) len = textSize - 1;
+    }
+    text[ len ] = 0;
+    return pos + 1;
+}
+
+// Hashes of the words of the text: runs of letters, digits and '$'
+static int split_terms( const char *text, unsigned long long *hashes, int max ) {
+    int count = 0;
+    for( const char *p = text; *p && count < max; ) {
+        while ( *p && !isalnum( (unsigned char)*p ) ) p++;
+        const char *start = p;
+        while ( isalnum( (unsigned char)*p ) || *p == '$' ) p++;
+        if ( p > start ) hashes[ count++ ] = term_hash( start, p - start );
+    }
+    return count;
+}
+
+// Token of the keyword at the text (first in the table order, like the interpreter), 0 if none, the length in len
+static int find_keyword( const char *text, size_t *len ) {
+    for( int i = 0; i < TOKEN_COUNT; i++ ) {
+        *len = strlen( tokens[ i ] );
+        if ( isalpha( (unsigned char)tokens[ i ][ 0 ] ) && !strncasecmp( text, tokens[ i ], *len ) ) return 0x80 + i;
+    }
+    for( int i = 0; i < CG_TOKEN_COUNT; i++ ) {
+        *len = strlen( cgTokens[ i ] );
+        if ( !strncasecmp( text, cgTokens[ i ], *len ) ) return CG_PREFIX << 8 | ( 0x80 + i );
+    }
+    return 0;
+}
+
+/**
+ * Tokenizes the text like the interpreter, so it is split by the keywords like the indexed lines (GOTO10 is GOTO 10).
+ * The strings, the rest of the line after REM and the DATA items are not tokenized. Returns the size of the line body.
+ */
+static size_t tokenize_text( const char *text, unsigned char *body, size_t max ) {
+    size_t n = 0, len;
+    int quoted = 0, literal = 0; // 1 - DATA to the next ':', 2 - REM to the end
+    for( const char *p = text; *p && n + 2 < max; ) {
+        int token = 0;
+        if ( *p == '"' ) quoted = !quoted;
+        if ( *p == ':' && !quoted && literal == 1 ) literal = 0;
+        if ( !quoted && !literal && isalpha( (unsigned char)*p ) ) token = find_keyword( p, &len );
+        if ( !token ) {
+            body[ n++ ] = *p++;
+            continue;
+        }
+        if ( token > 0xFF ) body[ n++ ] = token >> 8;
+        body[ n++ ] = token;
+        p += len;
+        if ( token == 0x80 + 8 ) literal = 1; // DATA
+        if ( token == 0x80 + 19 ) literal = 2; // REM
+    }
+    return n;
+}
+
+static size_t read_tap( const char *path, unsigned char *data ) {
+    FILE *tap = fopen( path, "rb" );
+    if ( !tap ) {
+        fprintf( stderr, "Error opening %s.\n", path );
+        return 0;
+    }
+    size_t size = fread( data, 1, MAX_TAP, tap );
+    fclose( tap );
+    return size;
+}
+
+static void *index_thread( void *arg ) {
+    struct index_job *job = arg;
+    unsigned char *data = malloc( MAX_TAP );
+    size_t capacity = 0;
+    for( int doc = job->first; doc < job->count; doc += job->step ) {
+        size_t size = read_tap( job->paths[ doc ], data );
+        size_t pos = basic_body( data, size );
+        char text[ 1024 ];
+        unsigned long long hashes[ 256 ];
+        job->basic[ doc ] = pos != 0;
+        while ( pos && ( pos = detokenize_line( data, size, pos, text, sizeof( text ), 1 ) ) ) {
+            int count = split_terms( strchr( text, ' ' ) + 1, hashes, 256 ); // Without the line number
+            if ( job->postingCount + count > capacity ) {
+                capacity = ( capacity + count ) * 2;
+                job->postings = realloc( job->postings, capacity * sizeof( struct posting ) );
+            }
+            for( int i = 0; i < count; i++ ) {
+                job->postings[ job->postingCount ].hash = hashes[ i ];
+                job->postings[ job->postingCount++ ].doc = doc;
+            }
+        }
+    }
+    free( data );
+    return 0;
+}
+
+static int compare_postings( const void *a, const void *b ) {
+    const struct posting *x = a, *y = b;
+    if ( x->hash != y->hash ) return x->hash < y->hash ? -1 : 1;
+    return x->doc < y->doc ? -1 : x->doc > y->doc;
+}
+
+/**
+ * Maps the index file. Returns 0, if the index is empty.
+ */
+static unsigned char *map_index( int fd, size_t *size ) {
+    struct stat st;
+    *size = 0;
+    if ( fstat( fd, &st ) || !st.st_size ) return 0;
+    unsigned char *data = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( data == MAP_FAILED ) return 0;
+    *size = st.st_size;
+    return data;
+}
+
+// The segments of the index, and the check of their headers
+#define FOR_SEGMENTS( base, length, seg ) \
+    for( struct segment_header *seg = (struct segment_header*)( base ); \
+         (unsigned char*)seg < ( base ) + ( length ) && check_segment( seg, ( base ) + ( length ) ); \
+         seg = (struct segment_header*)( (unsigned char*)seg + seg->size ) )
+
+static int check_segment( struct segment_header *seg, unsigned char *end ) {
+    if ( memcmp( seg->magic, "TGRP", 4 ) || (unsigned char*)seg + seg->size > end || seg->size < sizeof( *seg ) ) {
+        fprintf( stderr, "Invalid index file.\n" );
+        exit(2);
+    }
+    return 1;
+}
+
+static struct doc_entry *segment_docs( struct segment_header *seg ) { return (struct doc_entry*)( seg + 1 ); }
+static struct term_entry *segment_terms( struct segment_header *seg ) { return (struct term_entry*)( segment_docs( seg ) + seg->docCount ); }
+static unsigned int *segment_postings( struct segment_header *seg ) { return (unsigned int*)( segment_terms( seg ) + seg->termCount ); }
+
+/**
+ * The last document of the paths: open addressing hash table of the documents of all segments, built once per run,
+ * so the lookup of a path does not scan the document tables.
+ */
+struct doc_map {
+    struct doc_entry **slots;  // 0 - empty
+    size_t mask;
+};
+
+static struct doc_entry **find_doc( struct doc_map *map, const char *path ) {
+    unsigned long long h = term_hash( path, strlen( path ) );
+    for( size_t s = ( h ^ h >> 32 ) & map->mask; ; s = ( s + 1 ) & map->mask ) {
+        if ( !map->slots[ s ] || !strcmp( map->slots[ s ]->path, path ) ) return &map->slots[ s ];
+    }
+}
+
+static void build_doc_map( struct doc_map *map, unsigned char *index, size_t size ) {
+    size_t count = 0, slots = 16;
+    if ( index ) FOR_SEGMENTS( index, size, seg ) count += seg->docCount;
+    while ( slots < count * 2 ) slots <<= 1;
+    map->slots = calloc( slots, sizeof( struct doc_entry* ) );
+    map->mask = slots - 1;
+    if ( index ) FOR_SEGMENTS( index, size, seg ) {
+        for( unsigned int i = 0; i < seg->docCount; i++ ) *find_doc( map, segment_docs( seg )[ i ].path ) = &segment_docs( seg )[ i ]; // The later overwrites
+    }
+}
+
+static void add_taps( const char *indexName, int argc, char *argv[], int threads ) {
+    int fd = open( indexName, O_RDWR | O_CREAT, 0644 );
+    if ( fd < 0 ) {
+        fprintf( stderr, "Error opening %s.\n", indexName );
+        exit(4);
+    }
+    size_t indexSize;
+    unsigned char *index = map_index( fd, &indexSize );
+    struct doc_map map;
+    build_doc_map( &map, index, indexSize );
+    // The new and changed tapes
+    char **paths = malloc( ( argc + 1 ) * sizeof( char* ) );
+    int count = 0, unchanged = 0;
+    for( int i = 0; i < argc; i++ ) {
+        struct stat st;
+        if ( strlen( argv[ i ] ) >= MAX_PATH ) {
+            fprintf( stderr, "Too long path (max %d characters): %s\n", MAX_PATH - 1, argv[ i ] );
+            continue;
+        }
+        if ( stat( argv[ i ], &st ) ) {
+            fprintf( stderr, "Error opening %s.\n", argv[ i ] );
+            continue;
+        }
+        struct doc_entry *doc = *find_doc( &map, argv[ i ] );
+        if ( doc && doc->mtime == st.st_mtime && doc->size == st.st_size ) {
+            unchanged++;
+        } else {
+            paths[ count++ ] = argv[ i ];
+        }
+    }
+    free( map.slots );
+    if ( index ) munmap( index, indexSize );
+    // Parallel detokenizing
+    if ( threads > count ) threads = count ? count : 1;
+    struct index_job jobs[ MAX_THREADS ];
+    int *basic = calloc( count + 1, sizeof( int ) );
+    for( int t = 0; t < threads; t++ ) {
+        jobs[ t ] = (struct index_job){ paths, count, threads, t, 0, 0, basic };
+        pthread_create( &jobs[ t ].thread, 0, index_thread, &jobs[ t ] );
+    }
+    size_t postingCount = 0;
+    for( int t = 0; t < threads; t++ ) {
+        pthread_join( jobs[ t ].thread, 0 );
+        postingCount += jobs[ t ].postingCount;
+    }
+    struct posting *postings = malloc( ( postingCount + 1 ) * sizeof( struct posting ) );
+    postingCount = 0;
+    for( int t = 0; t < threads; t++ ) {
+        memcpy( postings + postingCount, jobs[ t ].postings, jobs[ t ].postingCount * sizeof( struct posting ) );
+        postingCount += jobs[ t ].postingCount;
+        free( jobs[ t ].postings );
+    }
+    qsort( postings, postingCount, sizeof( struct posting ), compare_postings );
+    // Segment: the BASIC tapes only, the postings without duplicates
+    int *docNumbers = malloc( ( count + 1 ) * sizeof( int ) );
+    struct doc_entry *docs = calloc( count + 1, sizeof( struct doc_entry ) );
+    struct term_entry *terms = malloc( ( postingCount + 1 ) * sizeof( struct term_entry ) );
+    unsigned int *docIds = malloc( ( postingCount + 1 ) * sizeof( unsigned int ) );
+    struct segment_header seg = { { 'T','G','R','P' } };
+    for( int i = 0; i < count; i++ ) {
+        if ( !basic[ i ] ) continue;
+        struct stat st;
+        stat( paths[ i ], &st );
+        snprintf( docs[ seg.docCount ].path, MAX_PATH, "%s", paths[ i ] );
+        docs[ seg.docCount ].mtime = st.st_mtime;
+        docs[ seg.docCount ].size = st.st_size;
+        docNumbers[ i ] = seg.docCount++;
+    }
+    for( size_t i = 0; i < postingCount; i++ ) {
+        if ( i && postings[ i ].hash == postings[ i - 1 ].hash && postings[ i ].doc == postings[ i - 1 ].doc ) continue;
+        if ( !seg.termCount || terms[ seg.termCount - 1 ].hash != postings[ i ].hash ) {
+            terms[ seg.termCount ].hash = postings[ i ].hash;
+            terms[ seg.termCount ].first = seg.postingCount;
+            terms[ seg.termCount++ ].count = 0;
+        }
+        terms[ seg.termCount - 1 ].count++;
+        docIds[ seg.postingCount++ ] = docNumbers[ postings[ i ].doc ];
+    }
+    seg.size = sizeof( seg ) + seg.docCount * sizeof( struct doc_entry ) + seg.termCount * sizeof( struct term_entry ) + seg.postingCount * sizeof( unsigned int );
+    if ( seg.docCount ) {
+        lseek( fd, indexSize, SEEK_SET );
+        if ( write( fd, &seg, sizeof( seg ) ) != sizeof( seg ) ||
+             write( fd, docs, seg.docCount * sizeof( struct doc_entry ) ) != seg.docCount * sizeof( struct doc_entry ) ||
+             write( fd, terms, seg.termCount * sizeof( struct term_entry ) ) != seg.termCount * sizeof( struct term_entry ) ||
+             write( fd, docIds, seg.postingCount * sizeof( unsigned int ) ) != seg.postingCount * sizeof( unsigned int ) ) {
+            fprintf( stderr, "Error writing %s.\n", indexName );
+            ftruncate( fd, indexSize );
+            exit(4);
+        }
+    }
+    close( fd );
+    fprintf( stdout, "%u BASIC tapes added (%d not BASIC), %d unchanged, %u terms\n", seg.docCount, count - (int)seg.docCount, unchanged, seg.termCount );
+    free( postings );
+    free( docNumbers );
+    free( docs );
+    free( terms );
+    free( docIds );
+    free( basic );
+    free( paths );
+}
+
+static struct term_entry *find_term( struct segment_header *seg, unsigned long long hash ) {
+    struct term_entry *terms = segment_terms( seg );
+    unsigned int low = 0, high = seg->termCount;
+    while ( low < high ) {
+        unsigned int mid = ( low + high ) / 2;
+        if ( terms[ mid ].hash < hash ) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < seg->termCount && terms[ low ].hash == hash ? &terms[ low ] : 0;
+}
+
+// Copy of the text without spaces: the interpreter ignores them, so GOTO 10 is GOTO10
+static void squeeze( char *dest, const char *text, size_t size ) {
+    size_t len = 0;
+    for( ; *text && len + 1 < size; text++ ) if ( *text != ' ' ) dest[ len++ ] = *text;
+    dest[ len ] = 0;
+}
+
+// Prints the lines of the program, which contain the query text
+static int print_matches( const char *path, const char *text ) {
+    static unsigned char data[ MAX_TAP ];
+    char line[ 1024 ], squeezedLine[ 1024 ], squeezedText[ 1024 ];
+    int matches = 0;
+    size_t size = read_tap( path, data );
+    size_t pos = basic_body( data, size );
+    squeeze( squeezedText, text, sizeof( squeezedText ) );
+    while ( pos && ( pos = detokenize_line( data, size, pos, line, sizeof( line ), 0 ) ) ) {
+        squeeze( squeezedLine, strchr( line, ' ' ) + 1, sizeof( squeezedLine ) ); // Without the line number
+        if ( strcasestr( squeezedLine, squeezedText ) ) {
+            fprintf( stdout, "%s: %s\n", path, line );
+            matches++;
+        }
+    }
+    return matches;
+}
+
+// Marks the documents of the segment, which have all terms: hit is the term count
+static void find_docs( struct segment_header *seg, const unsigned long long *hashes, int count, unsigned char *hit ) {
+    unsigned int *postings = segment_postings( seg );
+    memset( hit, 0, seg->docCount );
+    for( int t = 0; t < count; t++ ) {
+        struct term_entry *term = find_term( seg, hashes[ t ] );
+        if ( !term ) {
+            memset( hit, 0xFF, seg->docCount );
+            return;
+        }
+        for( unsigned int i = 0; i < term->count; i++ ) {
+            if ( hit[ postings[ term->first + i ] ] == t ) hit[ postings[ term->first + i ] ] = t + 1;
+        }
+    }
+}
+
+/**
+ * The query words are searched as BASIC code, split by the keywords like the index, and as string text
+ * (the strings and the REM lines are not tokenized in the programs).
+ */
+static void query( const char *indexName, const char *text ) {
+    int fd = open( indexName, O_RDONLY );
+    if ( fd < 0 ) {
+        fprintf( stderr, "Error opening %s.\n", indexName );
+        exit(4);
+    }
+    size_t indexSize;
+    unsigned char *index = map_index( fd, &indexSize );
+    unsigned char line[ 1024 ] = { 1, 0, 0, 0 }; // Line link and line number before the tokenized body
+    char spaced[ 4096 ];
+    size_t bodySize = tokenize_text( text, line + 4, sizeof( line ) - 7 );
+    memset( line + 4 + bodySize, 0, 3 );
+    detokenize_line( line, bodySize + 7, 0, spaced, sizeof( spaced ), 1 );
+    unsigned long long codeHashes[ MAX_QUERY_TERMS ], textHashes[ MAX_QUERY_TERMS ];
+    int codeCount = split_terms( strchr( spaced, ' ' ) + 1, codeHashes, MAX_QUERY_TERMS );
+    int textCount = split_terms( text, textHashes, MAX_QUERY_TERMS );
+    int sameTerms = codeCount == textCount && !memcmp( codeHashes, textHashes, codeCount * sizeof( codeHashes[ 0 ] ) );
+    int programs = 0, candidates = 0;
+    long lines = 0;
+    struct doc_map map;
+    build_doc_map( &map, index, indexSize );
+    if ( index ) FOR_SEGMENTS( index, indexSize, seg ) {
+        unsigned char *codeHit = malloc( seg->docCount + 1 ), *textHit = malloc( seg->docCount + 1 );
+        find_docs( seg, codeHashes, codeCount, codeHit );
+        if ( !sameTerms ) find_docs( seg, textHashes, textCount, textHit );
+        for( unsigned int i = 0; i < seg->docCount; i++ ) {
+            struct doc_entry *doc = &segment_docs( seg )[ i ];
+            int hit = codeHit[ i ] == codeCount || ( !sameTerms && textHit[ i ] == textCount );
+            if ( !hit || *find_doc( &map, doc->path ) != doc ) continue; // Changed later
+            candidates++;
+            int found = print_matches( doc->path, text );
+            if ( found ) programs++;
+            lines += found;
+        }
+        free( codeHit );
+        free( textHit );
+    }
+    fprintf( stdout, "%ld lines in %d programs, %d candidates\n", lines, programs, candidates );
+    free( map.slots );
+    if ( index ) munmap( index, indexSize );
+    close( fd );
+}
+
+static void list_tap( const char *path ) {
+    static unsigned char data[ MAX_TAP ];
+    char line[ 1024 ];
+    size_t size = read_tap( path, data );
+    size_t pos = basic_body( data, size );
+    if ( !pos ) {
+        fprintf( stderr, "%s is not a BASIC tape\n", path );
+        exit(1);
+    }
+    while ( ( pos = detokenize_line( data, size, pos, line, sizeof( line ), 0 ) ) ) fprintf( stdout, "%s\n", line );
+}
+
+static void print_usage() {
+    printf( "tapgrep v%d.%d%c (build: %s)\n", VM, VS, VB, __DATE__ );
+    printf( "Full text index and search of Colour Genie BASIC tapes.\n");
+    printf( "Copyright 2022 by László Princz\n");
+    printf( "Usage:\n");
+    printf( "tapgrep -d <index> [-j <threads>] -a <tap_filename> [<tap_filename> ...]\n");
+    printf( "tapgrep -d <index> -q <text>\n");
+    printf( "tapgrep -l <tap_filename>\n");
+    printf( "Command line option:\n");
+    printf( "-d <index>   : index file\n");
+    printf( "-a           : adds the new and changed BASIC tapes to the index\n");
+    printf( "-j <threads> : indexer threads (default: number of cpus)\n");
+    printf( "-q <text>    : prints the program lines containing the text\n");
+    printf( "-l <tap>     : prints the detokenized program\n");
+    printf( "-h           : prints this text\n");
+    exit(1);
+}
+
+int main( int argc, char *argv[] ) {
+    int opt = 0;
+    int addMode = 0;
+    int threads = 0;
+    char *indexName = 0, *queryText = 0, *listName = 0;
+
+    while ( ( opt = getopt( argc, argv, "?had:j:q:l:" ) ) != -1 ) {
+        switch ( opt ) {
+            case '?':
+            case 'h':
+                print_usage();
+                break;
+            case 'a':
+                addMode = 1;
+                break;
+            case 'd':
+                indexName = optarg;
+                break;
+            case 'j':
+                threads = atoi( optarg );
+                break;
+            case 'q':
+                queryText = optarg;
+                break;
+            case 'l':
+                listName = optarg;
+                break;
+            default:
+                break;
+        }
+    }
+    if ( threads <= 0 ) threads = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( threads > MAX_THREADS ) threads = MAX_THREADS;
+
+    if ( listName ) {
+        list_tap( listName );
+    } else if ( indexName && addMode && optind < argc ) {
+        add_taps( indexName, argc - optind, argv + optind, threads );
+    } else if ( indexName && queryText ) {
+        query( indexName, queryText );
+    } else {
+        print_usage();
+    }
+    return 0;
+}
@@ -0,0 +1,346 @@
+/**
+ * Similarity index of Colour Genie tapes: finds the patched, cracked or relocated variants of a program.
+ * The payload of a tape is the data of the SYSTEM 0x3C blocks (without the addresses), or the BASIC lines
+ * (without the line links, which depend on the load address).
+ * The sketch is a MinHash of the 4 byte shingles of the payload: the minimum of SKETCH_SIZE hash functions over
+ * the rolling hash of the shingles. The ratio of equal minimums estimates the Jaccard similarity of the shingle sets.
+ * LSH: the sketch is split to BANDS bands. Two tapes are candidates, if a band is equal, and only the candidates
+ * are compared by the whole sketch.
+ * The index file is a header and fixed size records, the new tapes are appended. A record of a changed tape is
+ * appended again, and the last record of a path is valid. The query maps the file and scans the band keys.
+ * The paths are max MAX_PATH - 1 characters, the longer ones are rejected.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "getopt.h"
+
+#define VM 0
+#define VS 4
+#define VB 'b'
+
+#define SHINGLE 4
+#define SKETCH_SIZE 64
+#define BANDS 16
+#define ROWS ( SKETCH_SIZE / BANDS )
+#define MAX_PATH 256
+#define MAX_TAP 0x100000
+
+#pragma pack(1)
+struct sim_header {
+    char           magic[ 4 ];   // "TSIM"
+    unsigned char  version;      // 1
+    unsigned char  shingle;
+    unsigned char  sketchSize;
+    unsigned char  bands;
+};
+
+struct sim_record {
+    char               path[ MAX_PATH ];
+    long long          mtime;
+    long long          size;
+    unsigned int       payload;  // Payload bytes
+    unsigned char      type;     // 'S' - SYSTEM, 'B' - BASIC
+    unsigned char      reserved[ 3 ];
+    unsigned int       bands[ BANDS ];
+    unsigned int       sketch[ SKETCH_SIZE ];
+};
+#pragma pack()
+
+static struct sim_header header = { { 'T','S','I','M' }, 1, SHINGLE, SKETCH_SIZE, BANDS };
+static double threshold = 0.5;
+
+static unsigned long long mix64( unsigned long long x ) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    return x ^ ( x >> 31 );
+}
+
+/**
+ * Copies the payload of the tap to the buffer. Returns the payload size, and the type in type.
+ * The leader is skipped: 0xAA or 0x00 bytes with 0x66 or 0xA5 sync byte, or the emulator header.
+ */
+static size_t tap_payload( const unsigned char *data, size_t size, unsigned char *payload, unsigned char *type ) {
+    size_t pos = 0, n = 0;
+    if ( size > 32 && !memcmp( data, "Colour Genie - Virtual Tape File", 32 ) ) {
+        for( pos = 32; pos < size && data[ pos ]; pos++ );
+        pos++;
+    } else {
+        while ( pos < size && ( data[ pos ] == 0xAA || data[ pos ] == 0x00 ) ) pos++;
+    }
+    if ( pos < size && ( data[ pos ] == 0x66 || data[ pos ] == 0xA5 ) ) pos++;
+    if ( pos >= size ) return 0;
+    if ( data[ pos ] == 0x55 ) { // SYSTEM: the data of the blocks
+        *type = 'S';
+        pos += 7;
+        while ( pos + 4 < size && data[ pos ] == 0x3C ) {
+            unsigned int blockSize = data[ pos + 1 ] ? data[ pos + 1 ] : 256;
+            if ( pos + 4 + blockSize > size ) blockSize = size - pos - 4;
+            memcpy( payload + n, data + pos + 4, blockSize );
+            n += blockSize;
+            pos += 5 + blockSize;
+        }
+    } else { // BASIC: line numbers and the tokenized lines
+        *type = 'B';
+        pos += ( pos + 3 < size && data[ pos ] == 0xD3 && data[ pos + 1 ] == 0xD3 && data[ pos + 2 ] == 0xD3 ) ? 4 : 1;
+        while ( pos + 4 < size && ( data[ pos ] || data[ pos + 1 ] ) ) {
+            pos += 2; // Line link
+            while ( pos < size && data[ pos ] ) payload[ n++ ] = data[ pos++ ];
+            payload[ n++ ] = 0;
+            pos++;
+        }
+    }
+    return n;
+}
+
+// MinHash of the shingles, and the band keys
+static void sketch_payload( const unsigned char *payload, size_t size, struct sim_record *record ) {
+    unsigned long long mins[ SKETCH_SIZE ];
+    for( int i = 0; i < SKETCH_SIZE; i++ ) mins[ i ] = ~0ULL;
+    unsigned long long shingle = 0;
+    for( size_t pos = 0; pos < size; pos++ ) {
+        shingle = ( shingle << 8 | payload[ pos ] ) & ( ( 1ULL << ( 8 * SHINGLE ) ) - 1 ); // Rolling window
+        if ( pos + 1 < SHINGLE ) continue;
+        unsigned long long h = mix64( shingle );
+        for( int i = 0; i < SKETCH_SIZE; i++ ) {
+            unsigned long long v = mix64( h + 0x9E3779B97F4A7C15ULL * ( i + 1 ) );
+            if ( v < mins[ i ] ) mins[ i ] = v;
+        }
+    }
+    for( int i = 0; i < SKETCH_SIZE; i++ ) record->sketch[ i ] = mins[ i ] >> 32;
+    for( int b = 0; b < BANDS; b++ ) {
+        unsigned long long h = b;
+        for( int r = 0; r < ROWS; r++ ) h = mix64( h ^ record->sketch[ b * ROWS + r ] );
+        record->bands[ b ] = h;
+    }
+}
+
+// Reads the tap, and computes its record. Returns 0, if the tap has no payload.
+static int make_record( const char *path, struct sim_record *record ) {
+    static unsigned char data[ MAX_TAP ], payload[ MAX_TAP ];
+    struct stat st;
+    FILE *tap = fopen( path, "rb" );
+    if ( !tap || fstat( fileno( tap ), &st ) ) {
+        fprintf( stderr, "Error opening %s.\n", path );
+        exit(4);
+    }
+    size_t size = fread( data, 1, sizeof( data ), tap );
+    fclose( tap );
+    memset( record, 0, sizeof( *record ) );
+    snprintf( record->path, sizeof( record->path ), "%s", path );
+    record->mtime = st.st_mtime;
+    record->size = st.st_size;
+    record->payload = tap_payload( data, size, payload, &record->type );
+    if ( record->payload < SHINGLE ) return 0;
+    sketch_payload( payload, record->payload, record );
+    return 1;
+}
+
+/**
+ * Maps the index file. Returns the records and the record count in count, or 0 if the index is empty.
+ */
+static struct sim_record *map_index( int fd, size_t *count, size_t *mapSize ) {
+    struct stat st;
+    *count = 0;
+    if ( fstat( fd, &st ) || st.st_size < sizeof( header ) ) return 0;
+    *mapSize = st.st_size;
+    struct sim_header *h = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( h == MAP_FAILED ) return 0;
+    if ( memcmp( h, &header, sizeof( header ) ) ) {
+        fprintf( stderr, "Invalid index file, or different sketch parameters.\n" );
+        exit(2);
+    }
+    *count = ( st.st_size - sizeof( header ) ) / sizeof( struct sim_record );
+    return (struct sim_record*)( h + 1 );
+}
+
+/**
+ * The last record of the paths: open addressing hash table of the record indexes, built once per run,
+ * so the lookup of a path does not scan the index.
+ */
+struct path_map {
+    size_t *slots;  // Record index + 1, 0 - empty
+    size_t mask;
+};
+
+static size_t *find_path( struct path_map *map, struct sim_record *records, const char *path ) {
+    unsigned long long h = 0xCBF29CE484222325ULL; // FNV-1a
+    for( const char *p = path; *p; p++ ) h = ( h ^ (unsigned char)*p ) * 0x100000001B3ULL;
+    for( size_t s = mix64( h ) & map->mask; ; s = ( s + 1 ) & map->mask ) {
+        if ( !map->slots[ s ] || !strcmp( records[ map->slots[ s ] - 1 ].path, path ) ) return &map->slots[ s ];
+    }
+}
+
+static void build_path_map( struct path_map *map, struct sim_record *records, size_t count ) {
+    size_t size = 16;
+    while ( size < count * 2 ) size <<= 1;
+    map->slots = calloc( size, sizeof( size_t ) );
+    map->mask = size - 1;
+    for( size_t i = 0; i < count; i++ ) *find_path( map, records, records[ i ].path ) = i + 1; // The later overwrites
+}
+
+static void add_taps( const char *indexName, int argc, char *argv[] ) {
+    int fd = open( indexName, O_RDWR | O_CREAT, 0644 );
+    if ( fd < 0 ) {
+        fprintf( stderr, "Error opening %s.\n", indexName );
+        exit(4);
+    }
+    size_t count, mapSize;
+    struct sim_record *records = map_index( fd, &count, &mapSize );
+    if ( !records ) {
+        ftruncate( fd, 0 );
+        write( fd, &header, sizeof( header ) );
+    }
+    lseek( fd, sizeof( header ) + count * sizeof( struct sim_record ), SEEK_SET );
+    struct path_map map;
+    build_path_map( &map, records, count );
+    int added = 0, unchanged = 0;
+    for( int i = 0; i < argc; i++ ) {
+        struct sim_record record;
+        struct stat st;
+        if ( strlen( argv[ i ] ) >= MAX_PATH ) {
+            fprintf( stderr, "Too long path (max %d characters): %s\n", MAX_PATH - 1, argv[ i ] );
+            continue;
+        }
+        if ( stat( argv[ i ], &st ) ) {
+            fprintf( stderr, "Error opening %s.\n", argv[ i ] );
+            continue;
+        }
+        size_t last = *find_path( &map, records, argv[ i ] );
+        if ( last && records[ last - 1 ].mtime == st.st_mtime && records[ last - 1 ].size == st.st_size ) {
+            unchanged++;
+        } else if ( !make_record( argv[ i ], &record ) ) {
+            fprintf( stderr, "No payload in %s\n", argv[ i ] );
+        } else if ( write( fd, &record, sizeof( record ) ) != sizeof( record ) ) {
+            fprintf( stderr, "Error writing %s.\n", indexName );
+            exit(4);
+        } else {
+            added++;
+        }
+    }
+    free( map.slots );
+    if ( records ) munmap( (char*)records - sizeof( header ), mapSize );
+    close( fd );
+    fprintf( stdout, "%d tapes added, %d unchanged\n", added, unchanged );
+}
+
+struct match {
+    struct sim_record *record;
+    double similarity;
+};
+
+static int compare_matches( const void *a, const void *b ) {
+    const struct match *x = a, *y = b;
+    return x->similarity < y->similarity ? 1 : x->similarity > y->similarity ? -1 : strcmp( x->record->path, y->record->path );
+}
+
+static void query( const char *indexName, const char *tapName ) {
+    struct sim_record record;
+    int fd = open( indexName, O_RDONLY );
+    if ( fd < 0 ) {
+        fprintf( stderr, "Error opening %s.\n", indexName );
+        exit(4);
+    }
+    if ( !make_record( tapName, &record ) ) {
+        fprintf( stderr, "No payload in %s\n", tapName );
+        exit(1);
+    }
+    size_t count, mapSize;
+    struct sim_record *records = map_index( fd, &count, &mapSize );
+    struct match *matches = malloc( ( count + 1 ) * sizeof( struct match ) );
+    struct path_map map;
+    build_path_map( &map, records, count );
+    size_t matchCount = 0, candidates = 0;
+    for( size_t i = 0; i < count; i++ ) {
+        struct sim_record *r = &records[ i ];
+        int candidate = 0;
+        for( int b = 0; b < BANDS && !candidate; b++ ) candidate = r->bands[ b ] == record.bands[ b ];
+        if ( !candidate || *find_path( &map, records, r->path ) != i + 1 ) continue; // Only the last record of the path
+        candidates++;
+        int equal = 0;
+        for( int h = 0; h < SKETCH_SIZE; h++ ) equal += r->sketch[ h ] == record.sketch[ h ];
+        double similarity = (double)equal / SKETCH_SIZE;
+        if ( similarity >= threshold ) {
+            matches[ matchCount ].record = r;
+            matches[ matchCount++ ].similarity = similarity;
+        }
+    }
+    qsort( matches, matchCount, sizeof( struct match ), compare_matches );
+    fprintf( stdout, "%s: %s, %u payload bytes\n", tapName, record.type == 'S' ? "SYSTEM" : "BASIC", record.payload );
+    for( size_t i = 0; i < matchCount; i++ ) {
+        fprintf( stdout, "%5.1f%% %s (%u bytes)\n", 100.0 * matches[ i ].similarity, matches[ i ].record->path, matches[ i ].record->payload );
+    }
+    fprintf( stdout, "%zu matches, %zu candidates, %zu records\n", matchCount, candidates, count );
+    free( matches );
+    free( map.slots );
+    if ( records ) munmap( (char*)records - sizeof( header ), mapSize );
+    close( fd );
+}
+
+static void print_usage() {
+    printf( "tapsim v%d.%d%c (build: %s)\n", VM, VS, VB, __DATE__ );
+    printf( "Similarity index of Colour Genie tapes, finds the variants of a program.\n");
+    printf( "Copyright 2022 by László Princz\n");
+    printf( "Usage:\n");
+    printf( "tapsim -d <index> -a <tap_filename> [<tap_filename> ...]\n");
+    printf( "tapsim -d <index> [-t <similarity>] -q <tap_filename>\n");
+    printf( "Command line option:\n");
+    printf( "-d <index>    : index file\n");
+    printf( "-a            : adds the new and changed tapes to the index\n");
+    printf( "-q <tap>      : prints the similar tapes from the index\n");
+    printf( "-t <percent>  : minimum similarity of the query (default: 50)\n");
+    printf( "-h            : prints this text\n");
+    exit(1);
+}
+
+int main( int argc, char *argv[] ) {
+    int opt = 0;
+    int addMode = 0;
+    char *indexName = 0, *queryName = 0;
+
+    while ( ( opt = getopt( argc, argv, "?had:q:t:" ) ) != -1 ) {
+        switch ( opt ) {
+            case '?':
+            case 'h':
+                print_usage();
+                break;
+            case 'a':
+                addMode = 1;
+                break;
+            case 'd':
+                indexName = optarg;
+                break;
+            case 'q':
+                queryName = optarg;
+                break;
+            case 't':
+                if ( !sscanf( optarg, "%lf", &threshold ) ) {
+                    fprintf( stderr, "Error parsing argument for '-t'.\n");
+                    exit(2);
+                }
+                if ( threshold < 0 || threshold > 100 ) {
+                    fprintf( stderr, "Illegal similarity: %s.\n", optarg );
+                    exit(3);
+                }
+                threshold /= 100;
+                break;
+            default:
+                break;
+        }
+    }
+
+    if ( indexName && addMode && optind < argc ) {
+        add_taps( indexName, argc - optind, argv + optind );
+    } else if ( indexName && queryName ) {
+        query( indexName, queryName );
+    } else {
+        print_usage();
+    }
+    return 0;
+}
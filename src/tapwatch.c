@@ -0,0 +1,352 @@
+/**
+ * Watches directories with inotify, and rebuilds the outputs of the changed files with the converters:
+ * .cmd -> cmd2tap -> .tap, .cas -> cas2tap -> .tap, .tap -> tap2wav -> .wav
+ * The new .tap files are also changes, so a .cmd is converted to .wav in two steps.
+ * The events of a file are debounced: the file is converted, when it was not written for the debounce time.
+ * The conversions go through a job queue with max parallel jobs. The queue is keyed by the output, so an output
+ * is only once in the queue and never built twice in parallel (foo.cmd and foo.cas are both foo.tap), and the
+ * last changed input is converted. An output changed during its conversion is converted again after it.
+ * On an inotify queue overflow the events are lost, so the directories are scanned again.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include "getopt.h"
+
+#define VM 0
+#define VS 4
+#define VB 'b'
+
+#define MAX_DIRS 64
+#define MAX_FILES 4096
+#define MAX_ARGS 32
+
+enum file_state { IDLE, PENDING, QUEUED, RUNNING };
+
+struct converter {
+    const char *ext;    // Input extension
+    const char *name;   // Converter program
+    const char *outExt; // Output extension
+} converters[] = {
+    { ".cmd", "cmd2tap", ".tap" },
+    { ".cas", "cas2tap", ".tap" },
+    { ".tap", "tap2wav", ".wav" },
+};
+
+#define CONVERTER_COUNT ( sizeof( converters ) / sizeof( converters[ 0 ] ) )
+
+struct file {
+    char out[ PATH_MAX ];          // Output, the key of the file
+    char path[ PATH_MAX ];         // Input
+    struct converter *converter;
+    char nextPath[ PATH_MAX ];     // Input changed while running
+    struct converter *nextConverter;
+    enum file_state state;
+    int again;             // Changed while running
+    double deadline;       // End of the debounce time, in ms
+    pid_t pid;
+    double start;
+} files[ MAX_FILES ];
+
+static int fileCount = 0;
+static char *dirs[ MAX_DIRS ];
+static int watches[ MAX_DIRS ];
+static int dirCount = 0;
+static int queue[ MAX_FILES ]; // Queued files, FIFO
+static int queueHead = 0, queueCount = 0;
+static int maxJobs = 0;        // Default the number of cpus
+static int runningJobs = 0;
+static int debounceMs = 20;
+static int verbose = 0;
+static char *binDir = 0;       // Directory of the converters, default the PATH
+static char *wavArgs[ MAX_ARGS ]; // Extra tap2wav options
+static int wavArgCount = 0;
+
+static double now_ms() {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+static struct converter *find_converter( const char *name ) {
+    const char *ext = strrchr( name, '.' );
+    for( int i = 0; ext && i < CONVERTER_COUNT; i++ ) if ( !strcasecmp( ext, converters[ i ].ext ) ) return &converters[ i ];
+    return 0;
+}
+
+static struct file *find_file( const char *out ) {
+    for( int i = 0; i < fileCount; i++ ) if ( !strcmp( files[ i ].out, out ) ) return &files[ i ];
+    if ( fileCount == MAX_FILES ) {
+        fprintf( stderr, "Too many files.\n" );
+        return 0;
+    }
+    struct file *f = &files[ fileCount++ ];
+    snprintf( f->out, sizeof( f->out ), "%s", out );
+    f->state = IDLE;
+    return f;
+}
+
+// A write event of the file: the debounce time restarts
+static void file_changed( const char *dir, const char *name ) {
+    char path[ PATH_MAX ], out[ PATH_MAX ];
+    struct converter *converter = find_converter( name );
+    if ( !converter ) return;
+    snprintf( path, sizeof( path ), "%s/%s", dir, name );
+    snprintf( out, sizeof( out ), "%s", path );
+    strcpy( strrchr( out, '.' ), converter->outExt );
+    struct file *f = find_file( out );
+    if ( !f ) return;
+    f->deadline = now_ms() + debounceMs;
+    if ( f->state == RUNNING ) { // The input of the next conversion
+        snprintf( f->nextPath, sizeof( f->nextPath ), "%s", path );
+        f->nextConverter = converter;
+        f->again = 1;
+        return;
+    }
+    snprintf( f->path, sizeof( f->path ), "%s", path );
+    f->converter = converter;
+    if ( f->state == IDLE ) f->state = PENDING;
+}
+
+static void enqueue( struct file *f ) {
+    f->state = QUEUED;
+    queue[ ( queueHead + queueCount++ ) % MAX_FILES ] = f - files;
+}
+
+static void start_job( struct file *f ) {
+    char converter[ PATH_MAX ];
+    char *argv[ MAX_ARGS + 8 ];
+    int n = 0;
+    if ( binDir ) {
+        snprintf( converter, sizeof( converter ), "%s/%s", binDir, f->converter->name );
+    } else {
+        snprintf( converter, sizeof( converter ), "%s", f->converter->name );
+    }
+    argv[ n++ ] = converter;
+    if ( f->converter->outExt[ 1 ] == 'w' ) for( int i = 0; i < wavArgCount; i++ ) argv[ n++ ] = wavArgs[ i ];
+    argv[ n++ ] = "-i";
+    argv[ n++ ] = f->path;
+    argv[ n++ ] = "-o";
+    argv[ n++ ] = f->out;
+    argv[ n ] = 0;
+    f->start = now_ms();
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+        sigset_t mask;
+        sigemptyset( &mask );
+        sigprocmask( SIG_SETMASK, &mask, 0 );
+        if ( !verbose ) {
+            int null = open( "/dev/null", O_WRONLY );
+            dup2( null, 1 );
+        }
+        execvp( converter, argv );
+        fprintf( stderr, "Error starting %s.\n", converter );
+        _exit( 127 );
+    } else if ( pid > 0 ) {
+        f->pid = pid;
+        f->state = RUNNING;
+        runningJobs++;
+    } else {
+        fprintf( stderr, "Fork error\n" );
+        f->state = IDLE;
+    }
+}
+
+static void start_jobs() {
+    while ( queueCount && runningJobs < maxJobs ) {
+        struct file *f = &files[ queue[ queueHead ] ];
+        queueHead = ( queueHead + 1 ) % MAX_FILES;
+        queueCount--;
+        start_job( f );
+    }
+}
+
+static void finish_jobs() {
+    int status;
+    pid_t pid;
+    while ( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 ) {
+        for( int i = 0; i < fileCount; i++ ) {
+            struct file *f = &files[ i ];
+            if ( f->state == RUNNING && f->pid == pid ) {
+                int code = WIFEXITED( status ) ? WEXITSTATUS( status ) : 128 + WTERMSIG( status );
+                fprintf( stdout, "%s %s -> %s: %s, %.0f ms\n", f->converter->name, f->path, f->out, code ? "failed" : "ok", now_ms() - f->start );
+                if ( code ) fprintf( stdout, "  exit code %d\n", code );
+                fflush( stdout );
+                runningJobs--;
+                f->state = f->again ? PENDING : IDLE; // The deadline is from the last change
+                if ( f->again ) {
+                    snprintf( f->path, sizeof( f->path ), "%s", f->nextPath );
+                    f->converter = f->nextConverter;
+                }
+                f->again = 0;
+            }
+        }
+    }
+}
+
+// Queues the debounced files. Returns the poll timeout to the next deadline.
+static int queue_pending() {
+    double now = now_ms();
+    int timeout = -1;
+    for( int i = 0; i < fileCount; i++ ) {
+        struct file *f = &files[ i ];
+        if ( f->state == PENDING ) {
+            if ( f->deadline <= now ) {
+                enqueue( f );
+            } else if ( timeout < 0 || f->deadline - now + 1 < timeout ) {
+                timeout = f->deadline - now + 1;
+            }
+        }
+    }
+    return timeout;
+}
+
+// The files, which are newer than their output, are converted at start and after an event queue overflow
+static void scan_dir( const char *dir ) {
+    DIR *d = opendir( dir );
+    struct dirent *entry;
+    while ( d && ( entry = readdir( d ) ) ) {
+        char path[ PATH_MAX ], outName[ PATH_MAX ];
+        struct stat in, out;
+        struct converter *converter = find_converter( entry->d_name );
+        if ( !converter ) continue;
+        snprintf( path, sizeof( path ), "%s/%s", dir, entry->d_name );
+        snprintf( outName, sizeof( outName ), "%s", path );
+        strcpy( strrchr( outName, '.' ), converter->outExt );
+        if ( stat( path, &in ) || !S_ISREG( in.st_mode ) ) continue;
+        if ( stat( outName, &out ) || out.st_mtim.tv_sec < in.st_mtim.tv_sec ||
+            ( out.st_mtim.tv_sec == in.st_mtim.tv_sec && out.st_mtim.tv_nsec < in.st_mtim.tv_nsec ) ) {
+            file_changed( dir, entry->d_name );
+        }
+    }
+    if ( d ) closedir( d );
+}
+
+static void watch() {
+    int inotify = inotify_init1( IN_CLOEXEC | IN_NONBLOCK );
+    if ( inotify < 0 ) {
+        fprintf( stderr, "Error initializing inotify.\n" );
+        exit(4);
+    }
+    for( int i = 0; i < dirCount; i++ ) {
+        if ( ( watches[ i ] = inotify_add_watch( inotify, dirs[ i ], IN_CLOSE_WRITE | IN_MOVED_TO ) ) < 0 ) {
+            fprintf( stderr, "Error watching %s.\n", dirs[ i ] );
+            exit(4);
+        }
+    }
+    sigset_t mask;
+    sigemptyset( &mask );
+    sigaddset( &mask, SIGCHLD );
+    sigprocmask( SIG_BLOCK, &mask, 0 );
+    int sigfd = signalfd( -1, &mask, SFD_CLOEXEC );
+    for( int i = 0; i < dirCount; i++ ) scan_dir( dirs[ i ] );
+    fprintf( stdout, "Watching %d directories, max %d parallel jobs, %d ms debounce\n", dirCount, maxJobs, debounceMs );
+    fflush( stdout );
+    for( ;; ) {
+        int timeout = queue_pending();
+        start_jobs();
+        struct pollfd pfd[ 2 ] = { { sigfd, POLLIN }, { inotify, POLLIN } };
+        if ( poll( pfd, 2, timeout ) < 0 ) continue;
+        if ( pfd[ 0 ].revents & POLLIN ) {
+            struct signalfd_siginfo info;
+            read( sigfd, &info, sizeof( info ) );
+            finish_jobs();
+        }
+        if ( pfd[ 1 ].revents & POLLIN ) {
+            char events[ 4096 ] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+            ssize_t len;
+            while ( ( len = read( inotify, events, sizeof( events ) ) ) > 0 ) {
+                for( char *p = events; p < events + len; p += sizeof( struct inotify_event ) + ( (struct inotify_event*)p )->len ) {
+                    struct inotify_event *event = (struct inotify_event*)p;
+                    if ( event->mask & IN_Q_OVERFLOW ) { // Lost events: the running outputs are built again too
+                        for( int i = 0; i < fileCount; i++ ) {
+                            if ( files[ i ].state == RUNNING && !files[ i ].again ) {
+                                snprintf( files[ i ].nextPath, sizeof( files[ i ].nextPath ), "%s", files[ i ].path );
+                                files[ i ].nextConverter = files[ i ].converter;
+                                files[ i ].again = 1;
+                            }
+                        }
+                        for( int i = 0; i < dirCount; i++ ) scan_dir( dirs[ i ] );
+                    }
+                    for( int i = 0; event->len && i < dirCount; i++ ) {
+                        if ( watches[ i ] == event->wd ) file_changed( dirs[ i ], event->name );
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void print_usage() {
+    printf( "tapwatch v%d.%d%c (build: %s)\n", VM, VS, VB, __DATE__ );
+    printf( "Watches directories, and converts the changed .cmd and .cas files to .tap, and the .tap files to .wav.\n");
+    printf( "Copyright 2022 by László Princz\n");
+    printf( "Usage:\n");
+    printf( "tapwatch [options] <directory> [<directory> ...]\n");
+    printf( "Command line option:\n");
+    printf( "-d <ms>      : debounce time (default: %d ms)\n", debounceMs );
+    printf( "-j <jobs>    : max parallel conversions (default: number of cpus)\n");
+    printf( "-B <dir>     : directory of cmd2tap, cas2tap and tap2wav (default: PATH)\n");
+    printf( "-w <options> : tap2wav options, for example \"-t -f 22050\"\n");
+    printf( "-v           : prints the converter messages\n");
+    printf( "-h           : prints this text\n");
+    exit(1);
+}
+
+int main( int argc, char *argv[] ) {
+    int opt = 0;
+
+    while ( ( opt = getopt( argc, argv, "?hvd:j:B:w:" ) ) != -1 ) {
+        switch ( opt ) {
+            case '?':
+            case 'h':
+                print_usage();
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'd':
+                if ( !sscanf( optarg, "%i", &debounceMs ) ) {
+                    fprintf( stderr, "Error parsing argument for '-d'.\n");
+                    exit(2);
+                }
+                if ( debounceMs < 0 ) {
+                    fprintf( stderr, "Illegal debounce time: %i.\n", debounceMs );
+                    exit(3);
+                }
+                break;
+            case 'j':
+                maxJobs = atoi( optarg );
+                break;
+            case 'B':
+                binDir = optarg;
+                break;
+            case 'w':
+                for( char *arg = strtok( optarg, " " ); arg && wavArgCount < MAX_ARGS; arg = strtok( 0, " " ) ) wavArgs[ wavArgCount++ ] = arg;
+                break;
+            default:
+                break;
+        }
+    }
+    if ( maxJobs <= 0 ) maxJobs = sysconf( _SC_NPROCESSORS_ONLN );
+    for( int i = optind; i < argc && dirCount < MAX_DIRS; i++ ) dirs[ dirCount++ ] = argv[ i ];
+
+    if ( dirCount ) {
+        watch();
+    } else {
+        print_usage();
+    }
+    return 0;
+}
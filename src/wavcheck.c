@@ -0,0 +1,544 @@
+/**
+ * Colour Genie cassette loader simulation.
+ * Feeds a wav or CSW file through a model of the cassette input and the ROM bit timing loop,
+ * decodes the records, and reports the checksums and the timing margins.
+ * The sweep mode renders a tap file with tap2wav in many configurations, and searches the fastest
+ * baud for every sample rate and gain, which loads with margin.
+ *
+ * Cassette input model: the played sample amplified by the playback gain, and a comparator with hysteresis.
+ * Every level change of the comparator is an edge.
+ * ROM bit model: the first edge of a bit cell is the clock. The ROM waits the 4312H loop, and if an other edge
+ * came in this time, then the bit is 1. The next edge after the loop is the next clock.
+ * The loop time constants are calibrated from the two known good settings (105 at 1150 baud and 26 at 2900 baud),
+ * both put the sample point at 3/4 of the bit cell.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include "getopt.h"
+
+#define VM 0
+#define VS 4
+#define VB 'b'
+
+#define CPU_CLOCK 2216750.0
+#define LOOP_BASE_CYCLES 288.0  // Cycles between the clock edge and the first loop iteration
+#define LOOP_CYCLES 11.0        // Cycles of one iteration of the 4312H loop
+
+const unsigned char default4312H = 105;
+
+static int verbose = 0;
+static FILE *report = 0;              // Decoding messages, the sweep mode hides them
+static double playbackGain = 1.0;     // Amplification of the played samples
+static double hysteresis = 8.0;       // Comparator hysteresis in sample units (8 bit centered)
+static double minMarginUs = 20.0;     // Required margin for a successful load
+static unsigned char loop4312H = 105; // Actual value of the loader loop
+
+/* Bit decoder state */
+static double clockTime = -1;   // Time of the actual bit cell clock edge in seconds, -1 before the first edge
+static double dataTime = -1;    // Time of the data edge in the actual bit cell, -1 if none
+static double sampleDelay = 0;  // The loop time at the actual clock
+static double minMargin = 1e9;  // Minimum margin in the actual record
+static double tapeMinMargin = 1e9;
+static long   bitCounter = 0;
+static int    glitchCounter = 0;
+
+/* Byte decoder state */
+static int      synced = 0;
+static unsigned shiftReg = 0;
+static int      bitsInByte = 0;
+
+/* Record decoder state */
+enum { REC_FIRST, REC_NAME, REC_TYPE, REC_SIZE, REC_ADDR_LO, REC_ADDR_HI, REC_DATA, REC_CHECKSUM, REC_ENTRY_LO, REC_ENTRY_HI, REC_BASIC_HEADER, REC_BASIC, REC_DONE };
+static int      recState = REC_FIRST;
+static int      recCounter = 0;
+static unsigned recSize = 0;
+static unsigned recAddress = 0;
+static unsigned char recSum = 0;
+static char     programName[ 7 ] = { 0,0,0,0,0,0,0 };
+static int      nullCounter = 0;
+static int      blockCounter = 0;
+static int      errorCounter = 0;
+
+static double loop_time( unsigned char loop ) {
+    return ( LOOP_BASE_CYCLES + LOOP_CYCLES * loop ) / CPU_CLOCK;
+}
+
+// The loop value, which puts the sample point at 3/4 of the bit cell
+static int loop_for_baud( int baud ) {
+    return (int)( ( 0.75 * CPU_CLOCK / baud - LOOP_BASE_CYCLES ) / LOOP_CYCLES + 0.5 );
+}
+
+static void record_margin( double margin ) {
+    if ( margin < minMargin ) minMargin = margin;
+    if ( margin < tapeMinMargin ) tapeMinMargin = margin;
+}
+
+static void end_record( const char *text ) {
+    fprintf( report, "%s, min margin %.1f us%s\n", text, minMargin * 1e6, minMargin * 1e6 < minMarginUs ? " (LOW)" : "" );
+    minMargin = 1e9;
+}
+
+static void decode_byte( unsigned char byte ) {
+    char text[ 80 ];
+    switch ( recState ) {
+        case REC_FIRST:
+            if ( byte == 0x55 ) {
+                recState = REC_NAME;
+                recCounter = 0;
+            } else if ( byte == 0xD3 ) { // BASIC header: 3 x 0xD3 and the first character of the name
+                recState = REC_BASIC_HEADER;
+                recCounter = 1;
+            } else {
+                fprintf( report, "BASIC program. The first character of the name is %c\n", byte );
+                recState = REC_BASIC;
+                recCounter = 0;
+            }
+            break;
+        case REC_BASIC_HEADER:
+            if ( byte == 0xD3 && recCounter < 3 ) {
+                recCounter++;
+            } else {
+                fprintf( report, "BASIC program. The first character of the name is %c\n", byte );
+                recState = REC_BASIC;
+                recCounter = 0;
+            }
+            break;
+        case REC_NAME:
+            programName[ recCounter++ ] = byte;
+            if ( recCounter == 6 ) {
+                sprintf( text, "SYSTEM program name: '%s'", programName );
+                end_record( text );
+                recState = REC_TYPE;
+            }
+            break;
+        case REC_TYPE: // The ROM skips the bytes between the blocks
+            if ( byte == 0x3C ) {
+                recState = REC_SIZE;
+            } else if ( byte == 0x78 ) {
+                recState = REC_ENTRY_LO;
+            } else if ( verbose ) {
+                fprintf( report, "Skip byte 0x%02X between blocks\n", byte );
+            }
+            break;
+        case REC_SIZE:
+            recSize = byte ? byte : 256;
+            recState = REC_ADDR_LO;
+            break;
+        case REC_ADDR_LO:
+            recAddress = byte;
+            recSum = byte;
+            recState = REC_ADDR_HI;
+            break;
+        case REC_ADDR_HI:
+            recAddress |= byte << 8;
+            recSum += byte;
+            recCounter = 0;
+            recState = REC_DATA;
+            break;
+        case REC_DATA:
+            if ( ( ( recAddress + recCounter ) & 0xFFFF ) == 0x4312 ) {
+                loop4312H = byte; // The turbo loader block changes the loop at once
+                if ( verbose ) fprintf( report, "Loader loop changed to %d\n", byte );
+            }
+            recSum += byte;
+            if ( ++recCounter == recSize ) recState = REC_CHECKSUM;
+            break;
+        case REC_CHECKSUM:
+            blockCounter++;
+            if ( byte == recSum ) {
+                sprintf( text, "%d bytes SYSTEM DATA block to 0x%04X. Checksum ok (%02X)", recSize, recAddress, byte );
+            } else {
+                sprintf( text, "%d bytes SYSTEM DATA block to 0x%04X. Checksum error (%02X, sum=%02X)", recSize, recAddress, byte, recSum );
+                errorCounter++;
+            }
+            end_record( text );
+            recState = REC_TYPE;
+            break;
+        case REC_ENTRY_LO:
+            recAddress = byte;
+            recState = REC_ENTRY_HI;
+            break;
+        case REC_ENTRY_HI:
+            recAddress |= byte << 8;
+            sprintf( text, "SYSTEM entry point: %04X", recAddress );
+            end_record( text );
+            recState = REC_DONE;
+            break;
+        case REC_BASIC:
+            recCounter++;
+            nullCounter = byte ? 0 : nullCounter + 1;
+            if ( nullCounter == 3 ) {
+                sprintf( text, "BASIC program: %d bytes", recCounter );
+                end_record( text );
+                recState = REC_DONE;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void decode_bit( int bit ) {
+    bitCounter++;
+    shiftReg = ( ( shiftReg << 1 ) | bit ) & 0xFFFF;
+    if ( !synced ) { // Leader: 0xAA bytes, sync: 0x66
+        if ( shiftReg == 0xAA66 ) {
+            synced = 1;
+            bitsInByte = 0;
+            minMargin = 1e9;
+            if ( verbose ) fprintf( report, "Sync byte found at bit %ld\n", bitCounter );
+        }
+    } else if ( ++bitsInByte == 8 ) {
+        bitsInByte = 0;
+        decode_byte( shiftReg & 0xFF );
+    }
+}
+
+// Process one comparator edge
+static void decode_edge( double t ) {
+    if ( recState == REC_DONE ) return;
+    if ( clockTime < 0 ) {
+        clockTime = t;
+        sampleDelay = loop_time( loop4312H );
+    } else if ( t < clockTime + sampleDelay ) { // Edge in the loop time: data edge of a 1 bit
+        if ( dataTime >= 0 ) {
+            glitchCounter++;
+        } else {
+            dataTime = t;
+        }
+    } else { // Next clock edge
+        double cell = t - clockTime;
+        if ( cell > 4 * sampleDelay ) { // Silence between the edges, restart the cell
+            clockTime = t;
+            dataTime = -1;
+            sampleDelay = loop_time( loop4312H );
+            return;
+        }
+        int bit = dataTime >= 0;
+        double margin = t - clockTime - sampleDelay;
+        if ( bit && clockTime + sampleDelay - dataTime < margin ) margin = clockTime + sampleDelay - dataTime;
+        if ( synced ) record_margin( margin );
+        if ( verbose > 1 ) fprintf( report, "bit %ld: %d at %.6f s, margin %.1f us\n", bitCounter, bit, clockTime, margin * 1e6 );
+        decode_bit( bit );
+        clockTime = t;
+        dataTime = -1;
+        sampleDelay = loop_time( loop4312H );
+    }
+}
+
+static unsigned int read_u32( unsigned char *p ) { return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24; }
+
+// Comparator model on the pcm samples
+static void decode_wav( FILE *wav ) {
+    unsigned char chunk[ 8 ], fmt[ 16 ], ds64[ 28 ];
+    unsigned int rate = 0, bits = 0;
+    unsigned long long dataSize = 0, ds64DataSize = 0;
+    if ( fread( chunk, 1, 4, wav ) != 4 || ( memcmp( chunk, "RIFF", 4 ) && memcmp( chunk, "RF64", 4 ) ) ) {
+        fprintf( stderr, "Not a wav file.\n" );
+        exit(1);
+    }
+    fseek( wav, 12, SEEK_SET );
+    while ( fread( chunk, 1, 8, wav ) == 8 ) {
+        unsigned int size = read_u32( chunk + 4 );
+        if ( !memcmp( chunk, "ds64", 4 ) ) { // RF64 sizes
+            if ( fread( ds64, 1, 28, wav ) != 28 ) break;
+            ds64DataSize = read_u32( ds64 + 8 ) | (unsigned long long)read_u32( ds64 + 12 ) << 32;
+            fseeko( wav, size - 28, SEEK_CUR );
+        } else if ( !memcmp( chunk, "fmt ", 4 ) ) {
+            if ( fread( fmt, 1, 16, wav ) != 16 ) break;
+            rate = read_u32( fmt + 4 );
+            bits = fmt[ 14 ];
+            fseek( wav, size - 16, SEEK_CUR );
+        } else if ( !memcmp( chunk, "data", 4 ) ) {
+            dataSize = ( size == 0xFFFFFFFF && ds64DataSize ) ? ds64DataSize : size;
+            break;
+        } else {
+            fseek( wav, size, SEEK_CUR );
+        }
+    }
+    if ( !rate || ( bits != 8 && bits != 16 ) || fmt[ 2 ] != 1 ) {
+        fprintf( stderr, "Unsupported wav format. Mono 8 or 16 bit pcm needed.\n" );
+        exit(1);
+    }
+    int high = 0;
+    double prev = 0;
+    unsigned long long n = 0;
+    unsigned char sample[ 2 ];
+    while ( n < dataSize && fread( sample, bits / 8, 1, wav ) == 1 ) {
+        double v = bits == 8 ? sample[ 0 ] - 128.0 : (short)( sample[ 0 ] | sample[ 1 ] << 8 ) / 256.0;
+        v *= playbackGain;
+        double threshold = high ? -hysteresis : hysteresis;
+        if ( ( high && v < threshold ) || ( !high && v > threshold ) ) { // Crossing between the two samples
+            double frac = ( v == prev ) ? 0 : ( threshold - prev ) / ( v - prev );
+            decode_edge( ( (double)n - 1 + frac ) / rate );
+            high = !high;
+        }
+        prev = v;
+        n++;
+    }
+}
+
+// The CSW pulses are the edges of an ideal comparator
+static void decode_csw( FILE *csw ) {
+    unsigned char header[ 0x34 ];
+    if ( fread( header, 1, sizeof( header ), csw ) != sizeof( header ) || header[ 0x17 ] != 2 ) {
+        fprintf( stderr, "Not a CSW v2 file.\n" );
+        exit(1);
+    }
+    unsigned int rate = read_u32( header + 0x19 );
+    fseek( csw, header[ 0x23 ], SEEK_CUR );
+    long start = ftell( csw );
+    fseek( csw, 0, SEEK_END );
+    long size = ftell( csw ) - start;
+    fseek( csw, start, SEEK_SET );
+    unsigned char *data = malloc( size );
+    if ( fread( data, 1, size, csw ) != size ) {
+        fprintf( stderr, "CSW read error.\n" );
+        exit(1);
+    }
+    if ( header[ 0x21 ] == 2 ) { // Z-RLE
+        uLongf rleSize = size * 16;
+        unsigned char *rle = 0;
+        int ret;
+        do {
+            rleSize *= 2;
+            rle = realloc( rle, rleSize );
+            ret = uncompress( rle, &rleSize, data, size );
+        } while ( ret == Z_BUF_ERROR );
+        if ( ret != Z_OK ) {
+            fprintf( stderr, "Z-RLE decompression error.\n" );
+            exit(1);
+        }
+        free( data );
+        data = rle;
+        size = rleSize;
+    }
+    double t = 0;
+    for( long i = 0; i < size; ) {
+        unsigned int len = data[ i++ ];
+        if ( !len && i + 4 <= size ) {
+            len = read_u32( data + i );
+            i += 4;
+        }
+        t += (double)len / rate;
+        decode_edge( t );
+    }
+    free( data );
+}
+
+static void reset_decoder() {
+    clockTime = dataTime = -1;
+    minMargin = tapeMinMargin = 1e9;
+    bitCounter = 0;
+    glitchCounter = 0;
+    synced = 0;
+    shiftReg = 0;
+    recState = REC_FIRST;
+    blockCounter = errorCounter = 0;
+    nullCounter = 0;
+    memset( programName, 0, sizeof( programName ) );
+}
+
+// Returns 0, if the file loaded without checksum error and with enough margin
+static int check_file( FILE *in, unsigned char loop ) {
+    unsigned char magic[ 4 ] = { 0,0,0,0 };
+    reset_decoder();
+    loop4312H = loop;
+    fread( magic, 1, 4, in );
+    fseek( in, 0, SEEK_SET );
+    if ( !memcmp( magic, "Comp", 4 ) ) {
+        decode_csw( in );
+    } else {
+        decode_wav( in );
+    }
+    fclose( in );
+    int ok = synced && recState == REC_DONE && !errorCounter && tapeMinMargin * 1e6 >= minMarginUs;
+    if ( !synced ) {
+        fprintf( report, "Sync byte not found. %ld bits decoded.\n", bitCounter );
+    } else if ( recState != REC_DONE ) {
+        fprintf( report, "Program end not found.\n" );
+    }
+    if ( glitchCounter ) fprintf( report, "%d extra edges in bit cells.\n", glitchCounter );
+    fprintf( report, "%s: %d blocks, %d checksum errors, min margin %.1f us\n", ok ? "OK" : "FAILED", blockCounter, errorCounter, tapeMinMargin * 1e6 );
+    return !ok;
+}
+
+// Runs tap2wav without a shell, so any character is allowed in the paths. Returns 0 on success.
+static int run_tap2wav( const char *tap2wav, int rate, int gain, int baud, const char *tapName, const char *wavName ) {
+    char rateArg[ 16 ], gainArg[ 16 ], baudArg[ 16 ];
+    snprintf( rateArg, sizeof( rateArg ), "%d", rate );
+    snprintf( gainArg, sizeof( gainArg ), "%d", gain );
+    snprintf( baudArg, sizeof( baudArg ), "%d", baud );
+    char *argv[] = { (char*)tap2wav, "-f", rateArg, "-g", gainArg, "-b", baudArg, "-i", (char*)tapName, "-o", (char*)wavName, NULL };
+    fflush( stdout );
+    pid_t pid = fork();
+    if ( pid < 0 ) return -1;
+    if ( !pid ) {
+        int fd = open( "/dev/null", O_WRONLY );
+        if ( fd >= 0 ) dup2( fd, STDOUT_FILENO );
+        execvp( tap2wav, argv );
+        _exit(127);
+    }
+    int status;
+    if ( waitpid( pid, &status, 0 ) < 0 ) return -1;
+    return !WIFEXITED( status ) || WEXITSTATUS( status );
+}
+
+/**
+ * Renders the tap in all supported sample rate and gain, and searches the fastest baud with
+ * enough margin. The loop value is computed for every baud.
+ */
+static void sweep( const char *tapName, const char *tap2wav, int maxBaud, int baudStep ) {
+    const int rates[] = { 8000, 11025, 22050, 44100, 48000 };
+    char wavName[] = "/tmp/wavcheckXXXXXX";
+    int fd = mkstemp( wavName );
+    if ( fd < 0 ) {
+        fprintf( stderr, "Error creating temporary file.\n" );
+        exit(4);
+    }
+    close( fd );
+    int bestBaud = 0, bestRate = 0, bestGain = 0;
+    FILE *null = fopen( "/dev/null", "w" );
+    fprintf( stdout, "rate   gain max baud (loop)\n" );
+    for( int r = 0; r < sizeof( rates ) / sizeof( rates[ 0 ] ); r++ ) {
+        for( int gain = 1; gain <= 7; gain++ ) {
+            int lastGood = 0;
+            for( int baud = 1150; baud <= maxBaud; baud += baudStep ) {
+                int loop = loop_for_baud( baud );
+                if ( loop < 1 || loop > 255 ) break;
+                if ( run_tap2wav( tap2wav, rates[ r ], gain, baud, tapName, wavName ) ) {
+                    fprintf( stderr, "Error running %s\n", tap2wav );
+                    unlink( wavName );
+                    exit(1);
+                }
+                FILE *wav = fopen( wavName, "rb" );
+                if ( !wav ) {
+                    fprintf( stderr, "Error opening %s.\n", wavName );
+                    exit(4);
+                }
+                report = null; // Only the summary needed
+                int failed = check_file( wav, loop );
+                report = stdout;
+                if ( failed ) break;
+                lastGood = baud;
+            }
+            fprintf( stdout, "%-6d %-4d %d (%d)\n", rates[ r ], gain, lastGood, lastGood ? loop_for_baud( lastGood ) : 0 );
+            if ( lastGood > bestBaud ) {
+                bestBaud = lastGood;
+                bestRate = rates[ r ];
+                bestGain = gain;
+            }
+        }
+    }
+    fclose( null );
+    unlink( wavName );
+    if ( bestBaud ) {
+        fprintf( stdout, "Fastest: %d baud (POKE 17170,%d) at %d Hz, gain %d\n", bestBaud, loop_for_baud( bestBaud ), bestRate, bestGain );
+    } else {
+        fprintf( stdout, "No configuration loads with %.1f us margin.\n", minMarginUs );
+    }
+}
+
+static void print_usage() {
+    printf( "wavcheck v%d.%d%c (build: %s)\n", VM, VS, VB, __DATE__ );
+    printf( "Colour Genie cassette loader simulation for wav and CSW files.\n");
+    printf( "Copyright 2022 by László Princz\n");
+    printf( "Usage:\n");
+    printf( "wavcheck [options] -i <wav_or_csw_filename>\n");
+    printf( "wavcheck -s [options] -i <tap_filename>\n");
+    printf( "Command line option:\n");
+    printf( "-l <loop>    : 4312H loader loop value (default: %d)\n", default4312H );
+    printf( "-a <gain>    : playback amplification (default: 1.0)\n");
+    printf( "-y <level>   : comparator hysteresis in 8 bit sample units (default: 8)\n");
+    printf( "-m <us>      : required timing margin in microseconds (default: 20)\n");
+    printf( "-s           : sweep mode, search the fastest baud for all sample rate and gain\n");
+    printf( "-B <baud>    : sweep mode max baud (default: 6000)\n");
+    printf( "-S <step>    : sweep mode baud step (default: 50)\n");
+    printf( "-w <tap2wav> : tap2wav executable for the sweep mode (default: tap2wav beside wavcheck, or from the PATH)\n");
+    printf( "-v           : verbose, -vv prints every bit\n");
+    printf( "-h           : prints this text\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt = 0;
+    int sweepMode = 0;
+    int maxBaud = 6000, baudStep = 50;
+    int loop = default4312H;
+    char *inName = 0;
+    char *tap2wav = 0;
+    report = stdout;
+
+    while ( ( opt = getopt( argc, argv, "?hvsl:a:y:m:B:S:w:i:" ) ) != -1 ) {
+        switch ( opt ) {
+            case '?':
+            case 'h':
+                print_usage();
+                break;
+            case 'v':
+                verbose++;
+                break;
+            case 's':
+                sweepMode = 1;
+                break;
+            case 'l':
+                loop = atoi( optarg );
+                if ( loop < 1 || loop > 255 ) {
+                    fprintf( stderr, "Illegal loop value: %i.\n", loop );
+                    exit(3);
+                }
+                break;
+            case 'a':
+                playbackGain = atof( optarg );
+                break;
+            case 'y':
+                hysteresis = atof( optarg );
+                break;
+            case 'm':
+                minMarginUs = atof( optarg );
+                break;
+            case 'B':
+                maxBaud = atoi( optarg );
+                break;
+            case 'S':
+                baudStep = atoi( optarg );
+                if ( baudStep < 1 ) baudStep = 1;
+                break;
+            case 'w':
+                tap2wav = optarg;
+                break;
+            case 'i':
+                inName = optarg;
+                break;
+            default:
+                break;
+        }
+    }
+
+    if ( !inName ) {
+        print_usage();
+    } else if ( sweepMode ) {
+        if ( !tap2wav && !strchr( argv[ 0 ], '/' ) ) { // Started from the PATH: tap2wav is searched there too
+            tap2wav = "tap2wav";
+        } else if ( !tap2wav ) {
+            char *path = strdup( argv[ 0 ] );
+            tap2wav = malloc( strlen( path ) + 10 );
+            sprintf( tap2wav, "%s/tap2wav", dirname( path ) );
+        }
+        sweep( inName, tap2wav, maxBaud, baudStep );
+    } else {
+        FILE *in = fopen( inName, "rb" );
+        if ( !in ) {
+            fprintf( stderr, "Error opening %s.\n", inName );
+            exit(4);
+        }
+        return check_file( in, loop );
+    }
+    return 0;
+}